@@ -13,13 +13,17 @@
 /* Temporary */
 #define fatal(...) ixp_eprint("ixpc: fatal: " __VA_ARGS__); \
 
+enum {
+	WriteBehind = 8,
+};
+
 static IxpClient *client;
 
 static void
 usage(void) {
 	fprintf(stderr,
-		   "usage: %1$s [-a <address>] {create | read | ls [-ld] | remove | write | append} <file>\n"
-		   "       %1$s [-a <address>] xwrite <file> <data>\n"
+		   "usage: %1$s [-s] [-a <address>] {create | read | ls [-dfl] | remove | write | append} <file>\n"
+		   "       %1$s [-s] [-a <address>] xwrite <file> <data>\n"
 		   "       %1$s -v\n", argv0);
 	exit(1);
 }
@@ -31,11 +35,14 @@ write_data(IxpCFid *fid, char *name) {
 	long len;
 
 	buf = emalloc(fid->iounit);;
+	fid->writebehind = WriteBehind;
 	do {
 		len = read(0, buf, fid->iounit);
 		if(len >= 0 && ixp_write(fid, buf, len) != len)
 			fatal("cannot write file '%s': %s\n", name, ixp_errbuf());
 	} while(len > 0);
+	if(!ixp_flush(fid))
+		fatal("cannot write file '%s': %s\n", name, ixp_errbuf());
 
 	free(buf);
 }
@@ -96,6 +103,35 @@ print_stat(Stat *s, int details) {
 	}
 }
 
+static void
+print_stats(IxpClient *c) {
+	static char *names[IXP_NRPC] = {
+		"version", "auth", "attach", "error",
+		"flush", "walk", "open", "create",
+		"read", "write", "clunk", "remove",
+		"stat", "wstat",
+	};
+	IxpClientStats st;
+	int i, j;
+
+	ixp_clientstats(c, &st);
+	fprintf(stderr, "sent %llu bytes, received %llu bytes\n",
+		(unsigned long long)st.sent, (unsigned long long)st.received);
+	fprintf(stderr, "in flight %u, max %u, waited for tags %llu times\n",
+		st.inflight, st.maxinflight, (unsigned long long)st.tagwait);
+	for(i = 0; i < IXP_NRPC; i++) {
+		if(st.nrpc[i] == 0)
+			continue;
+		fprintf(stderr, "%-8s %6llu rpcs %6llu errors  latency (us):", names[i],
+			(unsigned long long)st.nrpc[i], (unsigned long long)st.nerror[i]);
+		for(j = 0; j < IXP_NLAT; j++)
+			if(st.latency[i][j])
+				fprintf(stderr, " <%lu:%llu", 1UL << j,
+					(unsigned long long)st.latency[i][j]);
+		fprintf(stderr, "\n");
+	}
+}
+
 /* Service Functions */
 static int
 xappend(int argc, char *argv[]) {
@@ -241,13 +277,13 @@ xread(int argc, char *argv[]) {
 
 static int
 xls(int argc, char *argv[]) {
-	IxpMsg m;
-	Stat *stat;
-	IxpCFid *fid;
-	char *file, *buf;
-	int lflag, dflag, count, nstat, mstat, i;
+	IxpDir *dir;
+	Stat *stat, st;
+	char *file;
+	int lflag, dflag, fflag, nstat, mstat, i, ret;
+	uint fields;
 
-	lflag = dflag = 0;
+	lflag = dflag = fflag = 0;
 
 	ARGBEGIN{
 	case 'l':
@@ -256,6 +292,9 @@ xls(int argc, char *argv[]) {
 	case 'd':
 		dflag++;
 		break;
+	case 'f':
+		fflag++;
+		break;
 	default:
 		usage();
 	}ARGEND;
@@ -273,24 +312,38 @@ xls(int argc, char *argv[]) {
 	}
 	ixp_freestat(stat);
 
-	fid = ixp_open(client, file, P9_OREAD);
-	if(fid == nil)
+	dir = ixp_opendir(client, file);
+	if(dir == nil)
 		fatal("Can't open file '%s': %s\n", file, ixp_errbuf());
 
+	fields = IXP_SNAME;
+	if(lflag)
+		fields |= IXP_SUID | IXP_SGID;
+
+	/* With -f, entries are printed as they arrive, unsorted. */
 	nstat = 0;
-	mstat = 16;
-	stat = emalloc(sizeof(*stat) * mstat);
-	buf = emalloc(fid->iounit);
-	while((count = ixp_read(fid, buf, fid->iounit)) > 0) {
-		m = ixp_message(buf, count, MsgUnpack);
-		while(m.pos < m.end) {
-			if(nstat == mstat) {
-				mstat <<= 1;
-				stat = ixp_erealloc(stat, sizeof(*stat) * mstat);
-			}
-			ixp_pstat(&m, &stat[nstat++]);
+	mstat = 0;
+	stat = nil;
+	while((ret = ixp_readdir(dir, &st, fields)) > 0) {
+		if(fflag) {
+			print_stat(&st, lflag);
+			continue;
+		}
+		if(nstat == mstat) {
+			mstat = mstat ? mstat << 1 : 16;
+			stat = ixp_erealloc(stat, sizeof(*stat) * mstat);
+		}
+		stat[nstat] = st;
+		stat[nstat].name = estrdup(st.name);
+		if(lflag) {
+			stat[nstat].uid = estrdup(st.uid);
+			stat[nstat].gid = estrdup(st.gid);
 		}
+		nstat++;
 	}
+	if(ret < 0)
+		fatal("cannot read directory '%s': %s\n", file, ixp_errbuf());
+	ixp_closedir(dir);
 
 	qsort(stat, nstat, sizeof(*stat), comp_stat);
 	for(i = 0; i < nstat; i++) {
@@ -298,9 +351,6 @@ xls(int argc, char *argv[]) {
 		ixp_freestat(&stat[i]);
 	}
 	free(stat);
-
-	if(count == -1)
-		fatal("cannot read directory '%s': %s\n", file, ixp_errbuf());
 	return 0;
 }
 
@@ -323,9 +373,10 @@ int
 main(int argc, char *argv[]) {
 	char *cmd, *address;
 	exectab *tab;
-	int ret;
+	int ret, sflag;
 
 	address = getenv("IXP_ADDRESS");
+	sflag = 0;
 
 	ARGBEGIN{
 	case 'v':
@@ -334,6 +385,9 @@ main(int argc, char *argv[]) {
 	case 'a':
 		address = EARGF(usage());
 		break;
+	case 's':
+		sflag++;
+		break;
 	default:
 		usage();
 	}ARGEND;
@@ -354,6 +408,8 @@ main(int argc, char *argv[]) {
 
 	ret = tab->fn(argc, argv);
 
+	if(sflag)
+		print_stats(client);
 	ixp_unmount(client);
 	return ret;
 }
@@ -6,6 +6,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 
 /**
  * Macro: IXP_API
@@ -30,8 +31,8 @@
  * of libixp with a different API version than it was compiled
  * against.
  */
-#define IXP_API 135
-#define _IXP_ASSERT_VERSION ixp_version_ ## 135 ## _required
+#define IXP_API 136
+#define _IXP_ASSERT_VERSION ixp_version_ ## 136 ## _required
 
 #ifndef IXP_NEEDAPI
 #define IXP_NEEDAPI IXP_API
@@ -250,13 +251,18 @@ enum IxpDMode {
 
 typedef struct IxpMap IxpMap;
 typedef struct Ixp9Conn Ixp9Conn;
+typedef struct Ixp9ConnStats Ixp9ConnStats;
 typedef struct Ixp9Req Ixp9Req;
 typedef struct Ixp9Srv Ixp9Srv;
+typedef struct IxpArena IxpArena;
 typedef struct IxpCFid IxpCFid;
 typedef struct IxpClient IxpClient;
+typedef struct IxpClientStats IxpClientStats;
 typedef struct IxpConn IxpConn;
+typedef struct IxpDir IxpDir;
 typedef struct IxpFid IxpFid;
 typedef struct IxpMsg IxpMsg;
+typedef struct IxpPool IxpPool;
 typedef struct IxpQid IxpQid;
 typedef struct IxpRpc IxpRpc;
 typedef struct IxpServer IxpServer;
@@ -296,6 +302,9 @@ struct IxpMsg {
 	char*	end;  /* End of message. */ 
 	uint	size; /* Size of buffer. */
 	uint	mode; /* MsgPack or MsgUnpack. */
+
+	/* Private members */
+	IxpArena*	arena;
 };
 
 struct IxpQid {
@@ -306,6 +315,15 @@ struct IxpQid {
 	uint8_t		dir_type;
 };
 
+/* IxpStat string fields, for ixp_readdir */
+enum IxpSField {
+	IXP_SNAME	= 1,
+	IXP_SUID	= 2,
+	IXP_SGID	= 4,
+	IXP_SMUID	= 8,
+	IXP_SALL	= 15,
+};
+
 /* stat structure */
 struct IxpStat {
 	uint16_t	type;
@@ -388,12 +406,12 @@ struct IxpFTWalk {
 	IxpFHdr	hdr;
 	uint32_t	newfid;
 	uint16_t	nwname;
-	char*		wname[IXP_MAX_WELEM];
+	char**		wname;
 };
 struct IxpFRWalk {
 	IxpFHdr		hdr;
 	uint16_t	nwqid;
-	IxpQid		wqid[IXP_MAX_WELEM];
+	IxpQid*		wqid;
 };
 struct IxpFIO {
 	IxpFHdr		hdr;
@@ -502,6 +520,14 @@ struct IxpFcall {		  /* Deprecated */
  * RWrite are both represented by IxpFIO and can be accessed via the
  * P<io> member as well as P<tread> and P<rwrite> respectively.
  *
+ * The P<wname> and P<wqid> arrays of walk messages, of at most
+ * IXP_MAX_WELEM elements, are stored out of line so that they
+ * don't inflate every other message. When sending a TWalk,
+ * P<twalk.wname> must point to the caller's array of names.
+ * Unpacked RWalk arrays are malloc(3) allocated and freed by
+ * F<ixp_freefcall>. Servers receive both arrays with each
+ * request, allocated for the number of names walked.
+ *
  * See also:
  *	T<Ixp9Srv>, T<Ixp9Req>
  */
@@ -550,6 +576,7 @@ struct IxpConn {
 
 	/* Private members */
 	IxpConn		*next;
+	char		held;	/* Not read while non-zero. */
 };
 
 struct IxpServer {
@@ -561,28 +588,60 @@ struct IxpServer {
 	int		running;
 	int		maxfd;
 	fd_set		rd;
+
+	/* Private members */
+	int		wake[2];
 };
 
 struct IxpRpc {
 	IxpClient*	mux;
+	uint64_t	start;
+	uint64_t	deadline;
+	uint8_t		type;
 	IxpRpc*		next;
 	IxpRpc*		prev;
 	IxpRendez	r;
 	uint		tag;
 	IxpFcall*	p;
+	IxpFcall*	rx;
+	char*		rdata;
+	uint		rmax;
+	const struct iovec* iov;
+	uint		iovoff;
 	int		waiting;
 	int		async;
+	void		(*done)(IxpRpc*);
+};
+
+enum {
+	IXP_NRPC = 14, /* T-message types, by (type - P9_TVersion) / 2 */
+	IXP_NLAT = 24, /* Latency buckets */
+};
+
+struct IxpClientStats {
+	uint64_t	nrpc[IXP_NRPC];
+	uint64_t	nerror[IXP_NRPC];
+	uint64_t	latency[IXP_NRPC][IXP_NLAT];
+	uint64_t	sent;
+	uint64_t	received;
+	uint64_t	tagwait;
+	uint		inflight;
+	uint		maxinflight;
 };
 
 struct IxpClient {
 	int	fd;
 	uint	msize;
 	uint	lastfid;
+	uint	deferclunk;
+	uint	statwindow;
+	long	timeout;
 
 	/* Private members */
 	uint		nwait;
 	uint		mwait;
-	uint		freetag;
+	uint16_t*	freetag;
+	IxpRendez*	rendez;
 	IxpCFid*	freefid;
 	IxpMsg		rmsg;
 	IxpMsg		wmsg;
@@ -595,6 +654,22 @@ struct IxpClient {
 	IxpRpc		sleep;
 	int		mintag;
 	int		maxtag;
+	struct IxpLoop*	loop;
+	int		recvloop;
+	struct IxpWCache* wcache;
+	struct IxpDCache* dcache;
+	IxpCFid*	clunks;
+	IxpCFid*	lastclunk;
+	IxpClientStats	stats;
+};
+
+struct IxpPool {
+	IxpClient**	client;
+	uint		nclient;
+
+	/* Private members */
+	IxpMutex	lk;
+	uint		next;
 };
 
 struct IxpCFid {
@@ -605,10 +680,21 @@ struct IxpCFid {
 	uint		iounit;
 	uint32_t	offset;
 	IxpClient*	client;
+	uint		readahead;
+	uint		writebehind;
+	long		timeout;
 
 	/* Private members */
 	IxpCFid*	next;
 	IxpMutex	iolock;
+	IxpRpc*		clunk;
+	struct IxpAhead* ahead;
+	struct IxpAhead* spare;
+	int64_t		nextoff;
+	uint		nseq;
+	struct IxpBehind* behind;
+	uint		nbehind;
+	char*		werror;
 };
 
 /**
@@ -637,6 +723,15 @@ struct IxpFid {
 	IxpMap*		map;
 };
 
+/* Private: see arena.c */
+struct IxpArena {
+	char*		pos;
+	char*		end;
+	void*		chunks;
+	char*		buf;
+	uint		size;
+};
+
 struct Ixp9Req {
 	Ixp9Srv*	srv;
 	IxpFid*		fid;    /* Fid structure corresponding to IxpFHdr.fid */
@@ -648,6 +743,9 @@ struct Ixp9Req {
 
 	/* Private members */
 	Ixp9Conn *conn;
+	Ixp9Req*	next;
+	char		deferred;
+	IxpArena	arena;
 };
 
 struct Ixp9Srv {
@@ -664,6 +762,19 @@ struct Ixp9Srv {
 	void (*write)(Ixp9Req*);
 	void (*wstat)(Ixp9Req*);
 	void (*freefid)(IxpFid*);
+	uint maxinflight; /* Per connection. 0 for no limit. */
+	uint maxload; /* Across all connections. 0 for no limit. */
+
+	/* Private members */
+	uint load;
+};
+
+struct Ixp9ConnStats {
+	uint64_t	nreq;
+	uint64_t	nheld;
+	uint64_t	nbusy;
+	uint		inflight;
+	uint		maxinflight;
 };
 
 /**
@@ -688,6 +799,11 @@ struct Ixp9Srv {
  * pthread condition types. P<errbuf> should return a
  * thread-local buffer or the size IXP_ERRMAX.
  *
+ * P<tsleep> sleeps as P<sleep> does, but for no more than the
+ * given number of milliseconds. It may be nil, in which case a
+ * client's timeout is enforced only while the thread waiting
+ * for a reply is itself the one receiving replies.
+ *
  * See also:
  *	F<ixp_pthread_init>, F<ixp_taskinit>, F<ixp_rubyinit>
  */
@@ -718,6 +834,8 @@ struct IxpThread {
 	ssize_t	(*read)(int, void*, size_t);
 	ssize_t	(*write)(int, const void*, size_t);
 	int	(*select)(int, fd_set*, fd_set*, fd_set*, struct timeval*);
+	/* Optional */
+	void	(*tsleep)(IxpRendez*, long);
 };
 
 extern IxpThread*	ixp_thread;
@@ -737,21 +855,42 @@ int ixp_pthread_init(void);
 #endif
 
 /* client.c */
+IxpRpc*	ixp_afstat(IxpCFid*, IxpStat*, void (*)(long, void*), void*);
+IxpRpc*	ixp_apread(IxpCFid*, void*, long, int64_t, void (*)(long, void*), void*);
+IxpRpc*	ixp_apwrite(IxpCFid*, const void*, long, int64_t, void (*)(long, void*), void*);
+long	ixp_await(IxpRpc*);
+void	ixp_clientloop(IxpClient*);
 int	ixp_close(IxpCFid*);
+int	ixp_closedir(IxpDir*);
+int	ixp_clunksync(IxpClient*);
+int64_t	ixp_copy(IxpCFid*, IxpCFid*, int64_t, int64_t);
+void	ixp_clientstats(IxpClient*, IxpClientStats*);
+void	ixp_datacache(IxpClient*, long, uint);
+int	ixp_flush(IxpCFid*);
 long	ixp_pread(IxpCFid*, void*, long, int64_t);
+long	ixp_preadv(IxpCFid*, const struct iovec*, int, int64_t);
 int	ixp_print(IxpCFid*, const char*, ...);
 long	ixp_pwrite(IxpCFid*, const void*, long, int64_t);
+long	ixp_pwritev(IxpCFid*, const struct iovec*, int, int64_t);
 long	ixp_read(IxpCFid*, void*, long);
+int	ixp_readdir(IxpDir*, IxpStat*, uint);
+long	ixp_readfile(IxpClient*, const char*, void*, long);
 int	ixp_remove(IxpClient*, const char*);
+int	ixp_statv(IxpClient*, const char**, int, IxpStat**, char**);
 void	ixp_unmount(IxpClient*);
 int	ixp_vprint(IxpCFid*, const char*, va_list);
+void	ixp_walkcache(IxpClient*, uint, long);
 long	ixp_write(IxpCFid*, const void*, long);
+long	ixp_writefile(IxpClient*, const char*, const void*, long);
 IxpCFid*	ixp_create(IxpClient*, const char*, uint perm, uint8_t mode);
 IxpStat*	ixp_fstat(IxpCFid*);
+IxpConn*	ixp_listenclient(IxpServer*, IxpClient*);
 IxpClient*	ixp_mount(const char*);
 IxpClient*	ixp_mountfd(int);
+IxpClient*	ixp_mountsrv(Ixp9Srv*);
 IxpClient*	ixp_nsmount(const char*);
 IxpCFid*	ixp_open(IxpClient*, const char*, uint8_t);
+IxpDir*	ixp_opendir(IxpClient*, const char*);
 IxpStat*	ixp_stat(IxpClient*, const char*);
 
 /* convert.c */
@@ -774,6 +913,8 @@ void	ixp_rerrstr(char*, int);
 void	ixp_werrstr(const char*, ...);
 
 /* request.c */
+int	ixp_connstats(IxpConn*, Ixp9ConnStats*);
+void*	ixp_reqalloc(Ixp9Req*, uint);
 void ixp_respond(Ixp9Req*, const char *err);
 void ixp_serve9conn(IxpConn*);
 
@@ -785,6 +926,11 @@ void	ixp_freefcall(IxpFcall*);
 uint	ixp_msg2fcall(IxpMsg*, IxpFcall*);
 uint	ixp_fcall2msg(IxpMsg*, IxpFcall*);
 
+/* pool.c */
+IxpPool*	ixp_mountpool(const char*, int);
+IxpClient*	ixp_poolclient(IxpPool*);
+void	ixp_unmountpool(IxpPool*);
+
 /* server.c */
 IxpConn* ixp_listen(IxpServer*, int, void*,
 		void (*read)(IxpConn*),
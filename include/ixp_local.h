@@ -44,6 +44,14 @@ char *argv0;
 
 #define thread ixp_thread
 
+/*
+ * Reference counts which may be taken and dropped from any
+ * thread without a lock. decref returns the new count.
+ */
+#define incref(r) __atomic_add_fetch((r), 1, __ATOMIC_RELAXED)
+#define decref(r) __atomic_sub_fetch((r), 1, __ATOMIC_ACQ_REL)
+#define getref(r) __atomic_load_n((r), __ATOMIC_ACQUIRE)
+
 #define eprint ixp_eprint
 #define emalloc ixp_emalloc
 #define emallocz ixp_emallocz
@@ -53,8 +61,12 @@ char *argv0;
 #define tokenize ixp_tokenize
 
 #define muxinit ixp_muxinit
+#define muxloop ixp_muxloop
 #define muxfree ixp_muxfree
+#define muxpoll ixp_muxpoll
 #define muxrpc ixp_muxrpc
+#define muxrpcstart ixp_muxrpcstart
+#define muxrpcwait ixp_muxrpcwait
 
 #define errstr ixp_errstr
 #define rerrstr ixp_rerrstr
@@ -62,6 +74,7 @@ char *argv0;
 
 typedef struct IxpMap Map;
 typedef struct MapEnt MapEnt;
+typedef struct IxpLoop IxpLoop;
 
 typedef IxpTimer Timer;
 
@@ -74,6 +87,33 @@ struct IxpMap {
 	IxpRWLock	lock;
 };
 
+enum {
+	TAG_BUCKETS = 61,
+	FID_BUCKETS = 61,
+};
+
+struct Ixp9Conn {
+	Map		tagmap;
+	Map		fidmap;
+	MapEnt*		taghash[TAG_BUCKETS];
+	MapEnt*		fidhash[FID_BUCKETS];
+	Ixp9Srv*	srv;
+	IxpConn*	conn;
+	IxpLoop*	loop;
+	IxpMutex	rlock;
+	IxpMutex	wlock;
+	IxpMsg		rmsg;
+	IxpMsg		wmsg;
+	Ixp9Req*	freereq[2];
+	int		nfree[2];
+	Ixp9Req*	deferred;
+	Ixp9Req*	deferredtail;
+	uint		ndeferred;
+	char		dispatching;
+	Ixp9ConnStats	stats;
+	int		ref;
+};
+
 struct IxpTimer {
 	Timer*		link;
 	uint64_t	msec;
@@ -82,6 +122,24 @@ struct IxpTimer {
 	void*		aux;
 };
 
+/* arena.c */
+void*	ixp_arenaalloc(IxpArena*, uint);
+void	ixp_arenainit(IxpArena*, char*, uint);
+bool	ixp_arenaowns(IxpArena*, const void*);
+void	ixp_arenareset(IxpArena*);
+
+/* convert.c */
+void*	ixp_unpackalloc(IxpMsg*, uint);
+
+/* loopback.c */
+void	ixp_loopclose(IxpLoop*);
+IxpLoop*	ixp_loopnew(Ixp9Srv*);
+void	ixp_loopfree(IxpLoop*);
+IxpFcall*	ixp_looprecv(IxpLoop*);
+int	ixp_loopwait(IxpLoop*, uint64_t);
+void	ixp_loopreply(IxpLoop*, IxpFcall*, IxpArena*);
+uint	ixp_loopsend(IxpLoop*, IxpFcall*);
+
 /* map.c */
 void	ixp_mapfree(IxpMap*, void(*)(void*));
 void	ixp_mapexec(IxpMap*, void(*)(void*, void*), void*);
@@ -93,8 +151,23 @@ void*	ixp_maprm(IxpMap*, ulong);
 /* mux.c */
 void	muxfree(IxpClient*);
 void	muxinit(IxpClient*);
-IxpFcall*	muxrpc(IxpClient*, IxpFcall*);
+void	muxloop(IxpClient*);
+int	muxpoll(IxpClient*);
+IxpFcall*	muxrpc(IxpClient*, IxpFcall*, char*, uint64_t);
+int	muxrpcstart(IxpClient*, IxpRpc*, IxpFcall*);
+IxpFcall*	muxrpcwait(IxpRpc*);
+
+/* request.c */
+void	ixp_closep9conn(Ixp9Conn*);
+int	ixp_admitreq(Ixp9Conn*, uint8_t, uint16_t);
+Ixp9Req*	ixp_newreq(Ixp9Conn*, uint8_t);
+void	ixp_startreq(Ixp9Req*);
+Ixp9Conn*	ixp_newp9conn(Ixp9Srv*);
+
+/* server.c */
+void	ixp_wakeserver(IxpServer*);
 
 /* timer.c */
+uint64_t	ixp_nsec(void);
 long	ixp_nexttimer(IxpServer*);
 
@@ -0,0 +1,99 @@
+/* See LICENSE file for license details. */
+#include <stdlib.h>
+#include "ixp_local.h"
+
+/*
+ * A bump allocator, embedded in each Ixp9Req, from which the
+ * strings and data of a decoded request and the payload of its
+ * response are allocated, so that they may all be released with
+ * a single reset when the request is answered. Allocations are
+ * made from the buffer the arena is initialized with, if any,
+ * until it is exhausted, and then from malloc(3) allocated
+ * chunks chained from it. Requests too large to share a chunk,
+ * such as the data of a large TWrite, get a chunk of their own.
+ */
+
+typedef struct Chunk Chunk;
+
+struct Chunk {
+	Chunk*		next;
+	uint		size;
+	uint64_t	data[];
+};
+
+enum {
+	ChunkSize = 1024,
+	Align = sizeof(uint64_t),
+};
+
+/* buf, if not nil, must be aligned for a uint64_t. */
+void
+ixp_arenainit(IxpArena *a, char *buf, uint size) {
+	a->chunks = nil;
+	a->buf = buf;
+	a->size = size;
+	a->pos = buf;
+	a->end = buf + size;
+}
+
+/* Frees any chunks and makes the initial buffer available again. */
+void
+ixp_arenareset(IxpArena *a) {
+	Chunk *c;
+
+	while((c = a->chunks)) {
+		a->chunks = c->next;
+		free(c);
+	}
+	a->pos = a->buf;
+	a->end = a->buf + a->size;
+}
+
+static Chunk*
+newchunk(IxpArena *a, uint size) {
+	Chunk *c;
+
+	c = emalloc(sizeof *c + size);
+	c->size = size;
+	c->next = a->chunks;
+	a->chunks = c;
+	return c;
+}
+
+void*
+ixp_arenaalloc(IxpArena *a, uint size) {
+	Chunk *c;
+	char *p;
+
+	/* Even empty allocations must be distinct, and owned by a. */
+	if(size == 0)
+		size = Align;
+	size = (size + Align-1) & ~(Align-1);
+	if(size <= a->end - a->pos) {
+		p = a->pos;
+		a->pos += size;
+		return p;
+	}
+	if(size > ChunkSize / 4)
+		return newchunk(a, size)->data;
+
+	c = newchunk(a, ChunkSize);
+	a->pos = (char*)c->data + size;
+	a->end = (char*)c->data + ChunkSize;
+	return c->data;
+}
+
+/* Returns true if p was allocated from a. */
+bool
+ixp_arenaowns(IxpArena *a, const void *p) {
+	const char *s;
+	Chunk *c;
+
+	s = p;
+	if(s >= a->buf && s < a->buf + a->size)
+		return true;
+	for(c=a->chunks; c; c=c->next)
+		if(s >= (char*)c->data && s < (char*)c->data + c->size)
+			return true;
+	return false;
+}
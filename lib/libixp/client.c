@@ -2,6 +2,7 @@
  * See LICENSE file for license details.
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -16,8 +17,36 @@
 
 enum {
 	RootFid = 1,
+	ReadAhead = 4,
+	SeqReads = 2,
+	StatWindow = 32,
+	VecWindow = 8,
+	CopyWindow = 8,
 };
 
+typedef struct Async Async;
+struct Async {
+	IxpRpc		rpc; /* Must be first */
+	IxpFcall	fcall; /* The reply */
+	uint8_t		type;
+	void*		buf;
+	long		count;
+	void		(*fn)(long, void*);
+	void*		aux;
+};
+
+static void dropahead(IxpCFid*);
+static void freeahead(IxpCFid*);
+static int syncwrites(IxpCFid*);
+static int astartin(IxpClient*, Async*, uint32_t, IxpFcall*, void*, long, void (*)(long, void*), void*);
+static IxpRpc* astart(IxpClient*, uint32_t, IxpFcall*, void*, long, void (*)(long, void*), void*);
+static long await(Async*);
+static int cachewalk(IxpClient*, IxpCFid*, char**, int);
+static void uncache(IxpClient*, const char*);
+static void freewcache(IxpClient*);
+static void freedcache(IxpClient*);
+static int reapclunks(IxpClient*, int);
+
 static int
 min(int a, int b) {
 	if(a < b)
@@ -25,10 +54,18 @@ min(int a, int b) {
 	return b;
 }
 
+static uint64_t
+deadline(long timeout) {
+	if(timeout <= 0)
+		return 0;
+	return ixp_msec() + timeout;
+}
+
 static IxpCFid*
 getfid(IxpClient *c) {
 	IxpCFid *f;
 
+	reapclunks(c, 0);
 	thread->lock(&c->lk);
 	f = c->freefid;
 	if(f != nil)
@@ -41,6 +78,7 @@ getfid(IxpClient *c) {
 	}
 	f->next = nil;
 	f->open = 0;
+	memset(&f->qid, 0, sizeof f->qid);
 	thread->unlock(&c->lk);
 	return f;
 }
@@ -62,30 +100,37 @@ putfid(IxpCFid *f) {
 	thread->unlock(&c->lk);
 }
 
+/*
+ * Sends fcall and replaces it with the reply. The data of an
+ * RRead is copied to data, if it's not nil, rather than
+ * allocated, and must not be freed.
+ */
 static int
-dofcall(IxpClient *c, IxpFcall *fcall) {
-	IxpFcall *ret;
+dofcalldata(IxpClient *c, IxpFcall *fcall, char *data, long timeout) {
+	uint8_t type;
 
-	ret = muxrpc(c, fcall);
-	if(ret == nil)
+	type = fcall->hdr.type;
+	if(muxrpc(c, fcall, data, deadline(timeout)) == nil)
 		return 0;
-	if(ret->hdr.type == RError) {
-		werrstr("%s", ret->error.ename);
+	if(fcall->hdr.type == RError) {
+		werrstr("%s", fcall->error.ename);
 		goto fail;
 	}
-	if(ret->hdr.type != (fcall->hdr.type^1)) {
+	if(fcall->hdr.type != (type^1)) {
 		werrstr("received mismatched fcall");
 		goto fail;
 	}
-	memcpy(fcall, ret, sizeof *fcall);
-	free(ret);
 	return 1;
 fail:
 	ixp_freefcall(fcall);
-	free(ret);
 	return 0;
 }
 
+static int
+dofcall(IxpClient *c, IxpFcall *fcall) {
+	return dofcalldata(c, fcall, nil, c->timeout);
+}
+
 /**
  * Function: ixp_unmount
  *
@@ -98,8 +143,26 @@ void
 ixp_unmount(IxpClient *client) {
 	IxpCFid *f;
 
-	shutdown(client->fd, SHUT_RDWR);
-	close(client->fd);
+	if(client->loop)
+		ixp_loopclose(client->loop);
+	else
+		shutdown(client->fd, SHUT_RDWR);
+
+	/* Wait for any receive loop to see the eof. */
+	thread->lock(&client->lk);
+	while(client->recvloop)
+		thread->sleep(&client->tagrend);
+	thread->unlock(&client->lk);
+
+	reapclunks(client, 1);
+
+	if(client->loop)
+		ixp_loopfree(client->loop);
+	else
+		close(client->fd);
+
+	freewcache(client);
+	freedcache(client);
 
 	muxfree(client);
 
@@ -125,6 +188,7 @@ allocmsg(IxpClient *c, int n) {
  * Function: ixp_mount
  * Function: ixp_mountfd
  * Function: ixp_nsmount
+ * Function: ixp_mountsrv
  * Type: IxpClient
  *
  * Params:
@@ -134,25 +198,42 @@ allocmsg(IxpClient *c, int n) {
  *	         which to connect to a 9P server.
  *	name:    The name of a socket in the process's canonical
  *	         namespace directory.
+ *	srv:     A server in the current process.
  *
  * Initiate a 9P connection with the server at P<address>,
  * connected to on P<fd>, or under the process's namespace
  * directory as P<name>.
  *
+ * ixp_mountsrv connects to P<srv> in process. Requests are
+ * passed to its handlers as T<IxpFcall> structures, in the
+ * thread which issues them, and responses are returned to the
+ * client as such. No messages are packed or unpacked and no
+ * system calls are made. Handlers may be entered from several
+ * threads at once, and may themselves make requests of the same
+ * client. If the handlers always respond before returning, the
+ * client may be used without a threading implementation.
+ *
+ * If the client's P<timeout> member is set, no request waits
+ * longer than that many milliseconds for its reply. Once it
+ * expires, the request is flushed, and the call fails with the
+ * error "timed out", unless the reply arrives before the
+ * server acknowledges the flush, in which case it is used as
+ * usual. Clunks and removes are never timed out, since they
+ * release their fids whether or not they succeed. Files opened
+ * by the client take its timeout as their own P<timeout>, which
+ * may be changed to bound reads, writes, and stats of the file
+ * alone.
+ *
  * Returns:
  *	A pointer to a new 9P client.
  * See also:
  *	F<ixp_open>, F<ixp_create>, F<ixp_remove>, F<ixp_unmount>
  */
 
-IxpClient*
-ixp_mountfd(int fd) {
-	IxpClient *c;
+static IxpClient*
+mount(IxpClient *c) {
 	IxpFcall fcall;
 
-	c = emallocz(sizeof *c);
-	c->fd = fd;
-
 	muxinit(c);
 
 	allocmsg(c, 256);
@@ -178,7 +259,7 @@ ixp_mountfd(int fd) {
 	}
 
 	c->mintag = 0;
-	c->maxtag = 255;
+	c->maxtag = IXP_NOTAG;
 	c->msize = fcall.version.msize;
 
 	allocmsg(c, fcall.version.msize);
@@ -197,6 +278,25 @@ ixp_mountfd(int fd) {
 	return c;
 }
 
+IxpClient*
+ixp_mountfd(int fd) {
+	IxpClient *c;
+
+	c = emallocz(sizeof *c);
+	c->fd = fd;
+	return mount(c);
+}
+
+IxpClient*
+ixp_mountsrv(Ixp9Srv *srv) {
+	IxpClient *c;
+
+	c = emallocz(sizeof *c);
+	c->fd = -1;
+	c->loop = ixp_loopnew(srv);
+	return mount(c);
+}
+
 IxpClient*
 ixp_mount(const char *address) {
 	int fd;
@@ -222,39 +322,53 @@ ixp_nsmount(const char *name) {
 	return c;
 }
 
-static IxpCFid*
-walk(IxpClient *c, const char *path) {
-	IxpCFid *f;
-	char *p;
+static int
+walkto(IxpClient *c, uint32_t fid, IxpCFid *f, char **wname, int n) {
 	IxpFcall fcall;
-	int n;
-
-	p = estrdup(path);
-	n = tokenize(fcall.twalk.wname, nelem(fcall.twalk.wname), p, '/');
-	f = getfid(c);
 
 	fcall.hdr.type = TWalk;
-	fcall.hdr.fid = RootFid;
-	fcall.twalk.nwname = n;
+	fcall.hdr.fid = fid;
 	fcall.twalk.newfid = f->fid;
+	fcall.twalk.nwname = n;
+	fcall.twalk.wname = wname;
 	if(dofcall(c, &fcall) == 0)
-		goto fail;
+		return 0;
 	if(fcall.rwalk.nwqid < n) {
 		werrstr("File does not exist");
 		if(fcall.rwalk.nwqid == 0)
 			werrstr("Protocol botch");
-		goto fail;
+		ixp_freefcall(&fcall);
+		return 0;
 	}
 
-	f->qid = fcall.rwalk.wqid[n-1];
-
+	if(n > 0)
+		f->qid = fcall.rwalk.wqid[n-1];
 	ixp_freefcall(&fcall);
+	return 1;
+}
+
+static IxpCFid*
+walk(IxpClient *c, const char *path) {
+	IxpCFid *f;
+	char *wname[IXP_MAX_WELEM];
+	char *p;
+	int n, ret;
+
+	p = estrdup(path);
+	n = tokenize(wname, nelem(wname), p, '/');
+	f = getfid(c);
+
+	if(c->wcache && n > 1)
+		ret = cachewalk(c, f, wname, n);
+	else
+		ret = walkto(c, RootFid, f, wname, n);
+
 	free(p);
+	if(!ret) {
+		putfid(f);
+		return nil;
+	}
 	return f;
-fail:
-	putfid(f);
-	free(p);
-	return nil;
 }
 
 static IxpCFid*
@@ -278,6 +392,42 @@ walkdir(IxpClient *c, char *path, const char **rest) {
 	return walk(c, path);
 }
 
+/*
+ * Collects the replies to deferred clunks and releases their
+ * fids. Unless all is set, only those whose replies have already
+ * arrived are collected, and, since it's called for every new
+ * fid, only up to the first still awaiting its reply, in the
+ * order they were sent. A fid is released even if its clunk
+ * fails, since the server forgets it either way.
+ */
+static int
+reapclunks(IxpClient *c, int all) {
+	IxpCFid *f, *next, **fp, *done;
+	int ret;
+
+	done = nil;
+	thread->lock(&c->lk);
+	for(fp=&c->clunks; (f = *fp); fp=&f->next)
+		if(!all && f->clunk->p == nil)
+			break;
+	if(fp != &c->clunks) {
+		done = c->clunks;
+		c->clunks = f;
+		*fp = nil;
+	}
+	thread->unlock(&c->lk);
+
+	ret = 1;
+	for(f=done; f; f=next) {
+		next = f->next;
+		if(ixp_await(f->clunk) < 0)
+			ret = 0;
+		f->clunk = nil;
+		putfid(f);
+	}
+	return ret;
+}
+
 static int
 clunk(IxpCFid *f) {
 	IxpClient *c;
@@ -287,14 +437,435 @@ clunk(IxpCFid *f) {
 	c = f->client;
 
 	fcall.hdr.type = TClunk;
+	if(c->deferclunk) {
+		f->clunk = astart(c, f->fid, &fcall, nil, 0, nil, nil);
+		if(f->clunk == nil) {
+			putfid(f);
+			return 0;
+		}
+		f->next = nil;
+		thread->lock(&c->lk);
+		if(c->clunks)
+			c->lastclunk->next = f;
+		else
+			c->clunks = f;
+		c->lastclunk = f;
+		thread->unlock(&c->lk);
+		return 1;
+	}
+
 	fcall.hdr.fid = f->fid;
 	ret = dofcall(c, &fcall);
-	if(ret)
-		putfid(f);
+	/* The server forgets the fid even if the clunk fails. */
+	putfid(f);
 	ixp_freefcall(&fcall);
 	return ret;
 }
 
+/*
+ * The walk cache holds fids for recently walked directories,
+ * keyed by path, so that walks may begin from the deepest cached
+ * ancestor of their target rather than from the root. When the
+ * target's parent isn't cached, walks to the parent and to the
+ * target are sent together, and the parent's fid is kept.
+ *
+ * Entries are dropped when they fail to walk, when they're older
+ * than the cache's maximum age, when the file at or above them is
+ * removed through this client, and by LRU order when the cache is
+ * full. Entries in use by a walk are never evicted until it's
+ * done.
+ */
+typedef struct IxpWCache WCache;
+typedef struct WEnt WEnt;
+
+enum {
+	WHash = 64,
+};
+
+struct WEnt {
+	WEnt*		hnext;
+	WEnt*		next;	/* LRU order, newest first */
+	WEnt*		prev;
+	IxpCFid*	fid;
+	char*		path;
+	uint		len;
+	ulong		hash;
+	long		time;
+	int		ref;
+	int		dead;
+};
+
+struct IxpWCache {
+	IxpMutex	lk;
+	WEnt*		hash[WHash];
+	WEnt		lru;
+	uint		nent;
+	uint		max;
+	long		maxage;
+};
+
+static ulong
+strhash(const char *s, uint len) {
+	ulong h;
+
+	h = 0;
+	while(len--)
+		h = h*31 + (unsigned char)*s++;
+	return h;
+}
+
+/* Joins wname as "a/b/c", storing the length of each prefix in len. */
+static char*
+joinpath(char **wname, int n, uint *len) {
+	char *s;
+	uint size;
+	int i;
+
+	size = 1;
+	for(i=0; i < n; i++)
+		size += strlen(wname[i]) + 1;
+	s = emalloc(size);
+
+	size = 0;
+	for(i=0; i < n; i++) {
+		if(i > 0)
+			s[size++] = '/';
+		strcpy(s + size, wname[i]);
+		size += strlen(wname[i]);
+		len[i] = size;
+	}
+	s[size] = '\0';
+	return s;
+}
+
+static void
+wcunlink(WCache *wc, WEnt *e) {
+	WEnt **ep;
+
+	for(ep=&wc->hash[e->hash % WHash]; *ep != e; ep=&(*ep)->hnext)
+		;
+	*ep = e->hnext;
+	e->next->prev = e->prev;
+	e->prev->next = e->next;
+	e->dead = 1;
+	wc->nent--;
+}
+
+static void
+wcfront(WCache *wc, WEnt *e) {
+	e->next = wc->lru.next;
+	e->prev = &wc->lru;
+	e->next->prev = e;
+	e->prev->next = e;
+}
+
+/*
+ * The following functions are called with wc->lk held. Entries
+ * which must be clunked are added to the list dead, linked by
+ * hnext, which is returned.
+ */
+static WEnt*
+wcdrop(WCache *wc, WEnt *e, WEnt *dead) {
+	if(!e->dead)
+		wcunlink(wc, e);
+	if(e->ref == 0) {
+		e->hnext = dead;
+		dead = e;
+	}
+	return dead;
+}
+
+static WEnt*
+wctrim(WCache *wc, WEnt *dead) {
+	WEnt *e, *prev;
+
+	for(e=wc->lru.prev; e != &wc->lru && wc->nent > wc->max; e=prev) {
+		prev = e->prev;
+		if(e->ref == 0)
+			dead = wcdrop(wc, e, dead);
+	}
+	return dead;
+}
+
+/* Finds the longest of the first n prefixes of path in the cache. */
+static WEnt*
+wclookup(WCache *wc, const char *path, uint *len, int n, int *k, WEnt **dead) {
+	WEnt *e;
+	ulong h;
+	long now;
+
+	now = ixp_msec();
+	for(; n > 0; n--) {
+		h = strhash(path, len[n-1]);
+		for(e=wc->hash[h % WHash]; e; e=e->hnext)
+			if(e->hash == h && e->len == len[n-1] && !memcmp(e->path, path, e->len))
+				break;
+		if(e == nil)
+			continue;
+		if(wc->maxage > 0 && now - e->time > wc->maxage) {
+			*dead = wcdrop(wc, e, *dead);
+			continue;
+		}
+		e->next->prev = e->prev;
+		e->prev->next = e->next;
+		wcfront(wc, e);
+		e->ref++;
+		*k = n;
+		return e;
+	}
+	return nil;
+}
+
+static WEnt*
+wcrelease(WCache *wc, WEnt *e, int stale, WEnt *dead) {
+	e->ref--;
+	if(stale || e->dead)
+		return wcdrop(wc, e, dead);
+	return wctrim(wc, dead);
+}
+
+static WEnt*
+wcinsert(WCache *wc, IxpCFid *d, const char *path, uint len, WEnt *dead) {
+	WEnt *e, *e2;
+
+	e = emallocz(sizeof *e);
+	e->fid = d;
+	e->path = emalloc(len + 1);
+	memcpy(e->path, path, len);
+	e->path[len] = '\0';
+	e->len = len;
+	e->hash = strhash(path, len);
+	e->time = ixp_msec();
+
+	for(e2=wc->hash[e->hash % WHash]; e2; e2=e2->hnext)
+		if(e2->hash == e->hash && e2->len == len && !memcmp(e2->path, path, len))
+			break;
+	if(e2 || !(d->qid.type & P9_QTDIR)) {
+		e->dead = 1;
+		e->hnext = dead;
+		return e;
+	}
+
+	e->hnext = wc->hash[e->hash % WHash];
+	wc->hash[e->hash % WHash] = e;
+	wcfront(wc, e);
+	wc->nent++;
+	return wctrim(wc, dead);
+}
+
+static void
+clunkdone(long ret, void *aux) {
+	USED(ret);
+	putfid(aux);
+}
+
+/* Clunks the fids of dead entries, without waiting for replies. */
+static void
+wcfree(IxpClient *c, WEnt *e) {
+	IxpFcall fcall;
+	WEnt *next;
+
+	for(; e; e=next) {
+		next = e->hnext;
+		fcall.hdr.type = TClunk;
+		if(astart(c, e->fid->fid, &fcall, nil, 0, clunkdone, e->fid) == nil)
+			putfid(e->fid);
+		free(e->path);
+		free(e);
+	}
+}
+
+/*
+ * Walks from fid to d along the first n-1 elements of wname, and
+ * from d to f along the last, without waiting in between. Sets
+ * *dok if the first walk succeeds.
+ */
+static int
+walkpair(IxpClient *c, uint32_t fid, IxpCFid *d, IxpCFid *f, char **wname, int n, int *dok) {
+	IxpFcall fcall;
+	IxpRpc *r1, *r2;
+	int ok;
+
+	fcall.hdr.type = TWalk;
+	fcall.twalk.newfid = d->fid;
+	fcall.twalk.nwname = n-1;
+	fcall.twalk.wname = wname;
+	r1 = astart(c, fid, &fcall, &d->qid, n-1, nil, nil);
+	*dok = 0;
+	if(r1 == nil)
+		return 0;
+
+	fcall.hdr.type = TWalk;
+	fcall.twalk.newfid = f->fid;
+	fcall.twalk.nwname = 1;
+	fcall.twalk.wname = wname + n-1;
+	r2 = astart(c, d->fid, &fcall, &f->qid, 1, nil, nil);
+
+	ok = r2 && ixp_await(r2) == 0;
+	*dok = ixp_await(r1) == 0;
+	return ok && *dok;
+}
+
+static int
+cachewalk(IxpClient *c, IxpCFid *f, char **wname, int n) {
+	WCache *wc;
+	WEnt *e, *dead;
+	IxpCFid *d;
+	uint len[IXP_MAX_WELEM];
+	char *path;
+	int k, ret, dok;
+
+	wc = c->wcache;
+	if(wc->max == 0)
+		return walkto(c, RootFid, f, wname, n);
+
+	path = joinpath(wname, n, len);
+	dead = nil;
+
+	thread->lock(&wc->lk);
+	e = wclookup(wc, path, len, n-1, &k, &dead);
+	thread->unlock(&wc->lk);
+
+	if(e && k == n-1) {
+		ret = walkto(c, e->fid->fid, f, wname+k, 1);
+		thread->lock(&wc->lk);
+		dead = wcrelease(wc, e, !ret, dead);
+		thread->unlock(&wc->lk);
+		if(ret)
+			goto done;
+		/* The entry may be stale. Try again from the root. */
+		e = nil;
+	}
+
+	for(;;) {
+		if(e == nil)
+			k = 0;
+		d = getfid(c);
+		ret = walkpair(c, e ? e->fid->fid : RootFid, d, f, wname+k, n-k, &dok);
+
+		thread->lock(&wc->lk);
+		if(e)
+			dead = wcrelease(wc, e, !dok, dead);
+		if(dok)
+			dead = wcinsert(wc, d, path, len[n-2], dead);
+		thread->unlock(&wc->lk);
+		if(!dok)
+			putfid(d);
+		/* If the cached parent was walked, only the last element
+		 * is missing, and walking from the root won't help. */
+		if(ret || dok || e == nil)
+			break;
+		e = nil;
+	}
+
+done:
+	wcfree(c, dead);
+	free(path);
+	return ret;
+}
+
+/* Drops path, and anything below it, from the cache. */
+static void
+uncache(IxpClient *c, const char *path) {
+	WCache *wc;
+	WEnt *e, *next, *dead;
+	char *wname[IXP_MAX_WELEM];
+	uint len[IXP_MAX_WELEM];
+	char *p, *key;
+	int n;
+
+	wc = c->wcache;
+	p = estrdup(path);
+	n = tokenize(wname, nelem(wname), p, '/');
+	if(n == 0) {
+		free(p);
+		return;
+	}
+	key = joinpath(wname, n, len);
+
+	dead = nil;
+	thread->lock(&wc->lk);
+	for(e=wc->lru.next; e != &wc->lru; e=next) {
+		next = e->next;
+		if(e->len >= len[n-1] && !memcmp(e->path, key, len[n-1])
+		&& (e->len == len[n-1] || e->path[len[n-1]] == '/'))
+			dead = wcdrop(wc, e, dead);
+	}
+	thread->unlock(&wc->lk);
+
+	wcfree(c, dead);
+	free(key);
+	free(p);
+}
+
+static void
+freewcache(IxpClient *c) {
+	WCache *wc;
+	WEnt *e;
+
+	wc = c->wcache;
+	if(wc == nil)
+		return;
+	while((e = wc->lru.next) != &wc->lru) {
+		wcunlink(wc, e);
+		thread->mdestroy(&e->fid->iolock);
+		free(e->fid);
+		free(e->path);
+		free(e);
+	}
+	thread->mdestroy(&wc->lk);
+	free(wc);
+}
+
+/**
+ * Function: ixp_walkcache
+ *
+ * Params:
+ *	nent:   The maximum number of directories to cache. 0
+ *	        disables the cache.
+ *	maxage: The number of milliseconds for which a cached
+ *	        directory may be used, or 0 for no limit.
+ *
+ * Enables or resizes P<client>'s walk cache. Each directory
+ * walked through by F<ixp_open>, F<ixp_create>, F<ixp_stat> or
+ * F<ixp_remove> is kept open, up to P<nent> of the most recently
+ * used, so that later walks may begin from the deepest of them,
+ * rather than from the root.
+ *
+ * A cached directory is used for P<maxage> milliseconds from when
+ * it was walked to, and is dropped as soon as a walk from it
+ * fails, or it or a directory above it is removed by this
+ * client. Renames, and directories which resolve to different
+ * files over time, are not otherwise noticed; P<maxage> bounds
+ * how long they may go unnoticed.
+ *
+ * See also:
+ *	F<ixp_mount>, F<ixp_open>
+ */
+void
+ixp_walkcache(IxpClient *client, uint nent, long maxage) {
+	WCache *wc;
+	WEnt *dead;
+
+	thread->lock(&client->lk);
+	if(client->wcache == nil) {
+		wc = emallocz(sizeof *wc);
+		thread->initmutex(&wc->lk);
+		wc->lru.next = &wc->lru;
+		wc->lru.prev = &wc->lru;
+		client->wcache = wc;
+	}
+	wc = client->wcache;
+	thread->unlock(&client->lk);
+
+	thread->lock(&wc->lk);
+	wc->max = nent;
+	wc->maxage = maxage;
+	dead = wctrim(wc, nil);
+	thread->unlock(&wc->lk);
+	wcfree(client, dead);
+}
+
 /**
  * Function: ixp_remove
  *
@@ -321,6 +892,8 @@ ixp_remove(IxpClient *c, const char *path) {
 	fcall.hdr.type = TRemove;
 	fcall.hdr.fid = f->fid;;
 	ret = dofcall(c, &fcall);
+	if(ret && c->wcache)
+		uncache(c, path);
 	ixp_freefcall(&fcall);
 	putfid(f);
 
@@ -335,6 +908,16 @@ initfid(IxpCFid *f, IxpFcall *fcall) {
 	if(f->iounit == 0 || fcall->ropen.iounit > f->client->msize-24)
 		f->iounit =  f->client->msize-24;
 	f->qid = fcall->ropen.qid;
+	f->readahead = ReadAhead;
+	f->ahead = nil;
+	f->spare = nil;
+	f->nextoff = 0;
+	f->nseq = 0;
+	f->writebehind = 0;
+	f->timeout = f->client->timeout;
+	f->behind = nil;
+	f->nbehind = 0;
+	f->werror = nil;
 }
 
 /**
@@ -426,30 +1009,55 @@ ixp_open(IxpClient *c, const char *path, uint8_t mode) {
 
 /**
  * Function: ixp_close
+ * Function: ixp_clunksync
  *
  * Closes the file pointed to by P<f> and frees its
  * associated data structures;
  *
+ * If P<f>'s client has a nonzero P<deferclunk> member, the
+ * request to clunk the fid is sent without waiting for its
+ * reply, as are those sent when F<ixp_open> fails or
+ * F<ixp_stat> finishes. The fid is reused only once the reply
+ * has arrived. ixp_clunksync waits for the replies to all such
+ * requests, for callers which must know that the server has
+ * seen them, e.g. before expecting an ORCLOSE file to be gone.
+ *
  * Returns:
- *	Returns 1 on success, and zero on failure.
+ *	ixp_close returns 1 on success, and zero on failure,
+ *	including the failure of any write still outstanding. The
+ *	failure of a deferred clunk is reported only by
+ *	ixp_clunksync, which returns zero if any failed.
  * See also:
- *	F<ixp_mount>, F<ixp_open>
+ *	F<ixp_mount>, F<ixp_open>, F<ixp_flush>
  */
 
 int
 ixp_close(IxpCFid *f) {
-	return clunk(f);
+	int ret;
+
+	thread->lock(&f->iolock);
+	freeahead(f);
+	ret = syncwrites(f);
+	thread->unlock(&f->iolock);
+	if(!clunk(f))
+		return 0;
+	return ret;
+}
+
+int
+ixp_clunksync(IxpClient *c) {
+	return reapclunks(c, 1);
 }
 
 static IxpStat*
-_stat(IxpClient *c, ulong fid) {
+_stat(IxpClient *c, ulong fid, long timeout) {
 	IxpMsg msg;
 	IxpFcall fcall;
 	IxpStat *stat;
 
 	fcall.hdr.type = TStat;
 	fcall.hdr.fid = fid;
-	if(dofcall(c, &fcall) == 0)
+	if(dofcalldata(c, &fcall, nil, timeout) == 0)
 		return nil;
 
 	msg = ixp_message((char*)fcall.rstat.stat, fcall.rstat.nstat, MsgUnpack);
@@ -494,21 +1102,179 @@ ixp_stat(IxpClient *c, const char *path) {
 	if(f == nil)
 		return nil;
 
-	stat = _stat(c, f->fid);
+	stat = _stat(c, f->fid, c->timeout);
 	clunk(f);
 	return stat;
 }
 
 IxpStat*
 ixp_fstat(IxpCFid *fid) {
-	return _stat(fid->client, fid->fid);
+	IxpStat *stat;
+
+	stat = _stat(fid->client, fid->fid, fid->timeout);
+	if(stat) {
+		thread->lock(&fid->iolock);
+		fid->qid = stat->qid;
+		thread->unlock(&fid->iolock);
+	}
+	return stat;
+}
+
+/*
+ * Read-ahead. Once a fid has been read sequentially, with each
+ * read filled completely, further reads are served from a queue
+ * of up to f->readahead TReads issued at consecutive offsets
+ * past the caller's, and the queue is topped up as it drains.
+ * Any read at another offset, or any write, discards the queue.
+ * Discarded entries are kept on f->spare for reuse until the fid
+ * is closed, so that a steady stream of reads allocates nothing.
+ */
+typedef struct IxpAhead Ahead;
+struct IxpAhead {
+	Ahead*		next;
+	Async		async;
+	int		busy;	/* 0 once the reply is collected */
+	int64_t		offset;
+	long		count;	/* The number of bytes requested */
+	long		n;	/* The number of bytes received, or -1 */
+	long		pos;	/* The number of bytes consumed */
+	char		data[];
+};
+
+static void
+dropahead(IxpCFid *f) {
+	Ahead *a;
+
+	while((a = f->ahead)) {
+		f->ahead = a->next;
+		if(a->busy)
+			await(&a->async);
+		a->next = f->spare;
+		f->spare = a;
+	}
+}
+
+static void
+freeahead(IxpCFid *f) {
+	Ahead *a;
+
+	dropahead(f);
+	while((a = f->spare)) {
+		f->spare = a->next;
+		free(a);
+	}
+}
+
+static int
+canreadahead(IxpCFid *f) {
+	return f->readahead > 0
+	    && f->nseq >= SeqReads
+	    && !(f->qid.type & P9_QTDIR)
+	    && !(f->mode & P9_ODIRECT);
+}
+
+static void
+fillahead(IxpCFid *f) {
+	IxpFcall fcall;
+	Ahead *a, **tail;
+	int64_t offset;
+	uint n;
+
+	n = 0;
+	offset = f->nextoff;
+	for(tail=&f->ahead; *tail; tail=&(*tail)->next) {
+		offset = (*tail)->offset + (*tail)->count;
+		n++;
+	}
+	for(; n < f->readahead; n++) {
+		a = f->spare;
+		if(a)
+			f->spare = a->next;
+		else
+			a = emalloc(sizeof *a + f->iounit);
+		a->next = nil;
+		a->offset = offset;
+		a->count = f->iounit;
+		a->n = 0;
+		a->pos = 0;
+
+		fcall.hdr.type = TRead;
+		fcall.tread.offset = offset;
+		fcall.tread.count = a->count;
+		a->async.rpc.deadline = deadline(f->timeout);
+		a->busy = astartin(f->client, &a->async, f->fid, &fcall, a->data, a->count, nil, nil);
+		if(!a->busy) {
+			a->next = f->spare;
+			f->spare = a;
+			break;
+		}
+		*tail = a;
+		tail = &a->next;
+		offset += a->count;
+	}
 }
 
 static long
-_pread(IxpCFid *f, char *buf, long count, int64_t offset) {
+preadahead(IxpCFid *f, char *buf, long count) {
+	Ahead *a;
+	long n, len;
+
+	len = 0;
+	while(len < count) {
+		fillahead(f);
+		a = f->ahead;
+		if(a == nil)
+			return len ? len : -1;
+		if(a->busy) {
+			a->n = await(&a->async);
+			a->busy = 0;
+		}
+		if(a->n < 0) {
+			dropahead(f);
+			return len ? len : -1;
+		}
+
+		n = a->n - a->pos;
+		if(n > count - len)
+			n = count - len;
+		memcpy(buf + len, a->data + a->pos, n);
+		a->pos += n;
+		len += n;
+		if(a->pos < a->n)
+			break;
+
+		f->ahead = a->next;
+		f->nextoff = a->offset + a->n;
+		n = a->n < a->count;
+		a->next = f->spare;
+		f->spare = a;
+		if(n) {
+			/* End of file, or a short read. Start afresh. */
+			dropahead(f);
+			break;
+		}
+	}
+	return len;
+}
+
+static long
+fetch(IxpCFid *f, char *buf, long count, int64_t offset) {
 	IxpFcall fcall;
+	int64_t start;
 	int n, len;
 
+	start = offset;
+	if(offset != f->nextoff) {
+		dropahead(f);
+		f->nseq = 0;
+	}
+
+	if(f->ahead || canreadahead(f)) {
+		f->nextoff = offset;
+		len = preadahead(f, buf, count);
+		goto done;
+	}
+
 	len = 0;
 	while(len < count) {
 		n = min(count-len, f->iounit);
@@ -517,24 +1283,349 @@ _pread(IxpCFid *f, char *buf, long count, int64_t offset) {
 		fcall.hdr.fid = f->fid;
 		fcall.tread.offset = offset;
 		fcall.tread.count = n;
-		if(dofcall(f->client, &fcall) == 0)
-			return -1;
-		if(fcall.rread.count > n)
+		if(dofcalldata(f->client, &fcall, buf+len, f->timeout) == 0)
 			return -1;
 
-		memcpy(buf+len, fcall.rread.data, fcall.rread.count);
 		offset += fcall.rread.count;
 		len += fcall.rread.count;
 
-		ixp_freefcall(&fcall);
 		if(fcall.rread.count < n)
 			break;
 	}
+done:
+	if(len < 0)
+		return len;
+	f->nextoff = start + len;
+	if(len == count && count > 0)
+		f->nseq++;
+	else
+		f->nseq = 0;
 	return len;
 }
 
-/**
- * Function: ixp_read
+/*
+ * The data cache holds blocks of file data, keyed by qid path and
+ * block number, and tagged with the qid version of the fid which
+ * read them. A block is only used by fids whose version matches,
+ * which is the version returned when they were opened or last
+ * stat'd. Blocks are evicted in LRU order to keep the cache
+ * within its size limit, and are dropped when written to through
+ * this client. Each file's blocks are also listed together, so
+ * that they may be dropped without searching the whole cache.
+ */
+typedef struct IxpDCache DCache;
+typedef struct DEnt DEnt;
+typedef struct DFile DFile;
+
+enum {
+	DBlock = 4096,
+	DHash = 256,
+};
+
+struct DEnt {
+	DEnt*		hnext;
+	DEnt*		next;	/* LRU order, newest first */
+	DEnt*		prev;
+	DEnt*		fnext;	/* The file's other blocks */
+	DEnt*		fprev;
+	DFile*		file;
+	uint64_t	path;
+	uint32_t	version;
+	int64_t		block;
+	long		n;
+	char*		data;
+};
+
+struct DFile {
+	DFile*		hnext;
+	uint64_t	path;
+	DEnt*		blocks;
+};
+
+struct IxpDCache {
+	IxpMutex	lk;
+	DEnt*		hash[DHash];
+	DFile*		files[DHash];
+	DEnt		lru;
+	long		size;
+	long		max;
+	uint		qtypes;
+};
+
+static uint
+dchash(uint64_t path, int64_t block) {
+	return (uint)((path * 31 + block) % DHash);
+}
+
+/* Returns path's list of blocks, creating it if create is set. */
+static DFile*
+dcfile(DCache *dc, uint64_t path, int create) {
+	DFile *df, **dp;
+
+	dp = &dc->files[path % DHash];
+	for(df=*dp; df; df=df->hnext)
+		if(df->path == path)
+			return df;
+	if(create) {
+		df = emallocz(sizeof *df);
+		df->path = path;
+		df->hnext = *dp;
+		*dp = df;
+	}
+	return df;
+}
+
+static void
+dcunlink(DCache *dc, DEnt *e) {
+	DFile *df, **dp;
+	DEnt **ep;
+
+	for(ep=&dc->hash[dchash(e->path, e->block)]; *ep != e; ep=&(*ep)->hnext)
+		;
+	*ep = e->hnext;
+
+	df = e->file;
+	if(e->fprev)
+		e->fprev->fnext = e->fnext;
+	else
+		df->blocks = e->fnext;
+	if(e->fnext)
+		e->fnext->fprev = e->fprev;
+	if(df->blocks == nil) {
+		for(dp=&dc->files[df->path % DHash]; *dp != df; dp=&(*dp)->hnext)
+			;
+		*dp = df->hnext;
+		free(df);
+	}
+
+	e->next->prev = e->prev;
+	e->prev->next = e->next;
+	dc->size -= sizeof *e + e->n;
+	free(e);
+}
+
+static void
+dctrim(DCache *dc) {
+	while(dc->size > dc->max)
+		dcunlink(dc, dc->lru.prev);
+}
+
+static int
+cancache(IxpCFid *f) {
+	DCache *dc;
+
+	dc = f->client->dcache;
+	return dc->max > 0
+	    && !(f->qid.type & (P9_QTDIR|P9_QTAUTH))
+	    && !(f->qid.type & ~dc->qtypes & (P9_QTAPPEND|P9_QTEXCL|P9_QTTMP))
+	    && !(f->mode & P9_ODIRECT);
+}
+
+/*
+ * Copies the part of block from offset to buf, and returns the
+ * number of bytes copied, or -1 if the block isn't cached. *eof is
+ * set if the block ends the file.
+ */
+static long
+dcread(DCache *dc, IxpCFid *f, int64_t block, char *buf, long count, int64_t offset, int *eof) {
+	DEnt *e;
+	long n;
+
+	thread->lock(&dc->lk);
+	for(e=dc->hash[dchash(f->qid.path, block)]; e; e=e->hnext)
+		if(e->path == f->qid.path && e->block == block)
+			break;
+	if(e && e->version != f->qid.version) {
+		dcunlink(dc, e);
+		e = nil;
+	}
+	n = -1;
+	if(e) {
+		e->next->prev = e->prev;
+		e->prev->next = e->next;
+		e->next = dc->lru.next;
+		e->prev = &dc->lru;
+		e->next->prev = e;
+		e->prev->next = e;
+
+		n = e->n - (offset - block * DBlock);
+		if(n > count)
+			n = count;
+		if(n < 0)
+			n = 0;
+		memcpy(buf, e->data + (offset - block * DBlock), n);
+		*eof = e->n < DBlock;
+	}
+	thread->unlock(&dc->lk);
+	return n;
+}
+
+static void
+dcinsert(DCache *dc, IxpCFid *f, int64_t block, char *data, long n) {
+	DEnt *e, **ep;
+
+	e = emalloc(sizeof *e + n);
+	e->data = (char*)&e[1];
+	e->path = f->qid.path;
+	e->version = f->qid.version;
+	e->block = block;
+	e->n = n;
+	memcpy(e->data, data, n);
+
+	thread->lock(&dc->lk);
+	for(ep=&dc->hash[dchash(e->path, block)]; *ep; ep=&(*ep)->hnext)
+		if((*ep)->path == e->path && (*ep)->block == block) {
+			dcunlink(dc, *ep);
+			break;
+		}
+	e->hnext = dc->hash[dchash(e->path, block)];
+	dc->hash[dchash(e->path, block)] = e;
+	e->file = dcfile(dc, e->path, 1);
+	e->fprev = nil;
+	e->fnext = e->file->blocks;
+	if(e->fnext)
+		e->fnext->fprev = e;
+	e->file->blocks = e;
+	e->next = dc->lru.next;
+	e->prev = &dc->lru;
+	e->next->prev = e;
+	e->prev->next = e;
+	dc->size += sizeof *e + n;
+	dctrim(dc);
+	thread->unlock(&dc->lk);
+}
+
+static void
+dcdrop(DCache *dc, uint64_t path) {
+	DFile *df;
+	DEnt *e;
+	int last;
+
+	thread->lock(&dc->lk);
+	df = dcfile(dc, path, 0);
+	/* Unlinking the last block frees df. */
+	if(df)
+		do {
+			e = df->blocks;
+			last = e->fnext == nil;
+			dcunlink(dc, e);
+		}while(!last);
+	thread->unlock(&dc->lk);
+}
+
+static long
+cachedread(IxpCFid *f, char *buf, long count, int64_t offset) {
+	DCache *dc;
+	char *data;
+	int64_t block;
+	long m, n, len;
+	int eof;
+
+	dc = f->client->dcache;
+	data = nil;
+	len = 0;
+	while(len < count) {
+		block = (offset + len) / DBlock;
+		n = dcread(dc, f, block, buf + len, count - len, offset + len, &eof);
+		if(n < 0) {
+			if(data == nil)
+				data = emalloc(DBlock);
+			m = fetch(f, data, DBlock, block * DBlock);
+			if(m < 0) {
+				free(data);
+				return len ? len : -1;
+			}
+			dcinsert(dc, f, block, data, m);
+
+			eof = m < DBlock;
+			n = m - (offset + len - block * DBlock);
+			if(n > count - len)
+				n = count - len;
+			if(n < 0)
+				n = 0;
+			memcpy(buf + len, data + (offset + len - block * DBlock), n);
+		}
+		len += n;
+		if(n == 0 || eof)
+			break;
+	}
+	free(data);
+	return len;
+}
+
+static void
+freedcache(IxpClient *c) {
+	DCache *dc;
+
+	dc = c->dcache;
+	if(dc == nil)
+		return;
+	while(dc->lru.next != &dc->lru)
+		dcunlink(dc, dc->lru.next);
+	thread->mdestroy(&dc->lk);
+	free(dc);
+}
+
+/**
+ * Function: ixp_datacache
+ *
+ * Params:
+ *	size:   The maximum number of bytes to cache. 0
+ *	        disables the cache.
+ *	qtypes: A mask of the qid types P9_QTAPPEND, P9_QTEXCL
+ *	        and P9_QTTMP, whose files may be cached. Files of
+ *	        any of these types which aren't included are never
+ *	        cached.
+ *
+ * Enables or resizes P<client>'s data cache. Data read by
+ * F<ixp_read> and F<ixp_pread> is kept in blocks, up to P<size>
+ * bytes of the most recently used, and later reads from any fid
+ * for the same file are satisfied from it, so long as the fid's
+ * qid version matches that of the fid which read the block. A
+ * fid's version is the one returned when it was opened, and is
+ * updated by F<ixp_fstat>. Data written through the client drops
+ * the file's blocks from the cache.
+ *
+ * The cache is only useful for servers which update qid versions
+ * when files change. Files opened with P9_ODIRECT, directories
+ * and the types excluded by P<qtypes> always bypass it.
+ *
+ * See also:
+ *	F<ixp_mount>, F<ixp_pread>, F<ixp_walkcache>
+ */
+void
+ixp_datacache(IxpClient *client, long size, uint qtypes) {
+	DCache *dc;
+
+	thread->lock(&client->lk);
+	if(client->dcache == nil) {
+		dc = emallocz(sizeof *dc);
+		thread->initmutex(&dc->lk);
+		dc->lru.next = &dc->lru;
+		dc->lru.prev = &dc->lru;
+		client->dcache = dc;
+	}
+	dc = client->dcache;
+	thread->unlock(&client->lk);
+
+	thread->lock(&dc->lk);
+	dc->max = size;
+	dc->qtypes = qtypes;
+	dctrim(dc);
+	thread->unlock(&dc->lk);
+}
+
+static long
+_pread(IxpCFid *f, char *buf, long count, int64_t offset) {
+	if((f->behind || f->werror) && !syncwrites(f))
+		return -1;
+	if(f->client->dcache && cancache(f))
+		return cachedread(f, buf, count, offset);
+	return fetch(f, buf, count, offset);
+}
+
+/**
+ * Function: ixp_read
  * Function: ixp_pread
  *
  * Params:
@@ -548,6 +1639,15 @@ _pread(IxpCFid *f, char *buf, long count, int64_t offset) {
  * the number of bytes read. ixp_pread reads beginning at
  * P<offset> and does not alter P<fid>'s stored offset.
  *
+ * When a file is read sequentially, and each read returns all
+ * of the data requested, up to P<fid>->readahead reads of
+ * P<fid>->iounit bytes are kept outstanding beyond the current
+ * offset, so that large reads are not limited by the round
+ * trip time to the server. The read-ahead is discarded by any
+ * read at another offset, or any write to P<fid>. It is never
+ * done for directories or files opened with P9_ODIRECT, and
+ * may be disabled by setting P<fid>->readahead to 0.
+ *
  * Returns:
  *	These functions return the number of bytes read on
  *	success and -1 on failure.
@@ -577,11 +1677,108 @@ ixp_pread(IxpCFid *fid, void *buf, long count, int64_t offset) {
 	return n;
 }
 
+/*
+ * Write-behind. When f->writebehind is set, writes are copied
+ * and sent without waiting for their replies, with no more than
+ * f->writebehind outstanding at once. The first failure is kept
+ * in f->werror and reported by the next call to write, read,
+ * flush or close the fid.
+ */
+typedef struct IxpBehind Behind;
+struct IxpBehind {
+	Behind*		next;
+	IxpRpc*		rpc;
+	long		count;
+	char		data[];
+};
+
+static void
+reapwrite(IxpCFid *f) {
+	Behind *b;
+	long n;
+
+	b = f->behind;
+	f->behind = b->next;
+	f->nbehind--;
+
+	n = ixp_await(b->rpc);
+	if(n >= 0 && n != b->count)
+		werrstr("short write");
+	if(n != b->count && f->werror == nil)
+		f->werror = estrdup(ixp_errbuf());
+	free(b);
+}
+
+static int
+syncwrites(IxpCFid *f) {
+	while(f->behind)
+		reapwrite(f);
+	if(f->werror) {
+		werrstr("%s", f->werror);
+		free(f->werror);
+		f->werror = nil;
+		return 0;
+	}
+	return 1;
+}
+
+static long
+pwritebehind(IxpCFid *f, const char *buf, long count, int64_t offset) {
+	Behind *b, **tail;
+	long n, len;
+
+	tail = &f->behind;
+	while(*tail)
+		tail = &(*tail)->next;
+
+	len = 0;
+	do {
+		while(f->nbehind >= f->writebehind) {
+			reapwrite(f);
+			if(f->behind == nil)
+				tail = &f->behind;
+		}
+		if(f->werror)
+			break;
+		n = min(count-len, f->iounit);
+		b = emallocz(sizeof *b + n);
+		b->count = n;
+		memcpy(b->data, buf + len, n);
+		b->rpc = ixp_apwrite(f, b->data, n, offset, nil, nil);
+		if(b->rpc == nil) {
+			free(b);
+			f->werror = estrdup(ixp_errbuf());
+			break;
+		}
+		*tail = b;
+		tail = &b->next;
+		f->nbehind++;
+
+		offset += n;
+		len += n;
+	} while(len < count);
+
+	if(f->werror) {
+		syncwrites(f);
+		return -1;
+	}
+	return len;
+}
+
 static long
 _pwrite(IxpCFid *f, const void *buf, long count, int64_t offset) {
 	IxpFcall fcall;
 	int n, len;
 
+	dropahead(f);
+	f->nseq = 0;
+	if(f->client->dcache)
+		dcdrop(f->client->dcache, f->qid.path);
+
+	if(f->writebehind > 0 && !(f->qid.type & (P9_QTDIR|P9_QTAPPEND)))
+		return pwritebehind(f, buf, count, offset);
+	if((f->behind || f->werror) && !syncwrites(f))
+		return -1;
 	len = 0;
 	do {
 		n = min(count-len, f->iounit);
@@ -590,7 +1787,7 @@ _pwrite(IxpCFid *f, const void *buf, long count, int64_t offset) {
 		fcall.twrite.offset = offset;
 		fcall.twrite.data = (char*)buf + len;
 		fcall.twrite.count = n;
-		if(dofcall(f->client, &fcall) == 0)
+		if(dofcalldata(f->client, &fcall, nil, f->timeout) == 0)
 			return -1;
 
 		offset += fcall.rwrite.count;
@@ -606,6 +1803,7 @@ _pwrite(IxpCFid *f, const void *buf, long count, int64_t offset) {
 /**
  * Function: ixp_write
  * Function: ixp_pwrite
+ * Function: ixp_flush
  *
  * Params:
  *	buf:    A buffer holding the contents to store.
@@ -618,10 +1816,21 @@ _pwrite(IxpCFid *f, const void *buf, long count, int64_t offset) {
  * increments it by P<count>. ixp_pwrite writes its data a
  * P<offset> and does not alter C<fid>'s stored offset.
  *
+ * If C<fid>->writebehind is non-zero, the data is copied and
+ * sent in C<fid>->iounit sized pieces without waiting for
+ * their replies, so that no more than C<fid>->writebehind
+ * writes are outstanding at once. A failed write is reported
+ * by the next call to write or read the file, or to
+ * ixp_flush or F<ixp_close>. ixp_flush waits for every
+ * outstanding write on C<fid> to complete. Write-behind is not
+ * done for append-only files.
+ *
  * Returns:
- *	These functions return the number of bytes actually
- *	written. Any value less than P<count> must be considered
- *	a failure.
+ *	ixp_write and ixp_pwrite return the number of bytes
+ *	actually written, or accepted for writing, or -1 if an
+ *	earlier write failed. Any value less than P<count> must
+ *	be considered a failure. ixp_flush returns 1 if all
+ *	writes succeeded, and 0 otherwise.
  * See also:
  *	F<ixp_mount>, F<ixp_open>, F<ixp_read>
  */
@@ -648,6 +1857,784 @@ ixp_pwrite(IxpCFid *fid, const void *buf, long count, int64_t offset) {
 	return n;
 }
 
+int
+ixp_flush(IxpCFid *fid) {
+	int ret;
+
+	thread->lock(&fid->iolock);
+	ret = syncwrites(fid);
+	thread->unlock(&fid->iolock);
+	return ret;
+}
+
+/*
+ * Starts a TRead or TWrite of count bytes on f, whose data is
+ * scattered to or gathered from iov, beginning iovoff bytes in.
+ */
+static int
+vstart(IxpCFid *f, Async *a, uint8_t type, const struct iovec *iov, uint iovoff, long count, int64_t offset) {
+	IxpFcall fcall;
+
+	fcall.hdr.type = type;
+	fcall.hdr.fid = f->fid;
+	fcall.io.offset = offset;
+	fcall.io.count = count;
+	fcall.io.data = nil;
+
+	a->type = type;
+	a->buf = nil;
+	a->count = count;
+	a->fn = nil;
+	a->aux = nil;
+	a->rpc.done = nil;
+	a->rpc.rx = &a->fcall;
+	a->rpc.rdata = nil;
+	a->rpc.rmax = count;
+	a->rpc.iov = iov;
+	a->rpc.iovoff = iovoff;
+	a->rpc.deadline = deadline(f->timeout);
+	return muxrpcstart(f->client, &a->rpc, &fcall) == 0;
+}
+
+/*
+ * Splits a vectored read or write into requests of at most
+ * f->iounit bytes, with up to VecWindow of them outstanding, and
+ * stops at the first which fails or comes up short.
+ */
+static long
+vio(IxpCFid *f, uint8_t type, const struct iovec *iov, int iovcnt, int64_t offset) {
+	Async a[VecWindow];
+	char err[IXP_ERRMAX];
+	long total, len, ret, n;
+	size_t off;
+	int i, vi, head, nout, stop, failed;
+
+	total = 0;
+	for(i=0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	vi = 0;
+	off = 0;
+	len = 0;
+	ret = 0;
+	head = 0;
+	nout = 0;
+	stop = 0;
+	failed = 0;
+	while(nout > 0 || (!stop && len < total)) {
+		if(!stop && len < total && nout < VecWindow) {
+			while(off >= iov[vi].iov_len) {
+				off -= iov[vi].iov_len;
+				vi++;
+			}
+			n = total - len;
+			if(n > f->iounit)
+				n = f->iounit;
+			if(!vstart(f, &a[(head + nout) % VecWindow], type, &iov[vi], off, n, offset + len)) {
+				snprintf(err, sizeof err, "%s", ixp_errbuf());
+				stop = failed = 1;
+				continue;
+			}
+			nout++;
+			len += n;
+			off += n;
+			continue;
+		}
+		n = await(&a[head]);
+		if(!stop && n < 0) {
+			snprintf(err, sizeof err, "%s", ixp_errbuf());
+			stop = failed = 1;
+		}else if(!stop) {
+			ret += n;
+			if(n < a[head].count)
+				stop = 1;
+		}
+		head = (head + 1) % VecWindow;
+		nout--;
+	}
+	if(failed) {
+		err[sizeof err - 1] = '\0';
+		werrstr("%s", err);
+		return -1;
+	}
+	return ret;
+}
+
+/**
+ * Function: ixp_preadv
+ * Function: ixp_pwritev
+ *
+ * Params:
+ *	iov:    An array of buffers, as for readv(2) and
+ *	        writev(2).
+ *	iovcnt: The number of buffers in P<iov>.
+ *	offset: The offset at which to begin.
+ *
+ * ixp_preadv reads into, and ixp_pwritev writes from, each of
+ * the P<iovcnt> buffers at P<iov> in turn, as ixp_pread and
+ * ixp_pwrite would a single buffer holding them all. The data
+ * is scattered straight from the replies into the buffers, or
+ * gathered straight from them into the outgoing messages, with
+ * no intermediate copy. The transfer is split into requests of
+ * at most P<fid>->iounit bytes, up to 8 of which are sent
+ * without waiting for the replies to the others, and it stops
+ * at the first which is short. Neither function uses the
+ * fid's read-ahead, write-behind, or data cache.
+ *
+ * Returns:
+ *	The number of bytes read or written, or -1 on failure.
+ * See also:
+ *	F<ixp_pread>, F<ixp_pwrite>
+ */
+long
+ixp_preadv(IxpCFid *fid, const struct iovec *iov, int iovcnt, int64_t offset) {
+	long n;
+
+	thread->lock(&fid->iolock);
+	n = -1;
+	if(!(fid->behind || fid->werror) || syncwrites(fid))
+		n = vio(fid, TRead, iov, iovcnt, offset);
+	thread->unlock(&fid->iolock);
+	return n;
+}
+
+long
+ixp_pwritev(IxpCFid *fid, const struct iovec *iov, int iovcnt, int64_t offset) {
+	long n;
+
+	thread->lock(&fid->iolock);
+	dropahead(fid);
+	fid->nseq = 0;
+	if(fid->client->dcache)
+		dcdrop(fid->client->dcache, fid->qid.path);
+	n = -1;
+	if(!(fid->behind || fid->werror) || syncwrites(fid))
+		n = vio(fid, TWrite, iov, iovcnt, offset);
+	thread->unlock(&fid->iolock);
+	return n;
+}
+
+/*
+ * A copy keeps up to CopyWindow buffers in flight, each read
+ * from src and then written to dst at the same offset. Replies
+ * are collected in the order their requests were sent, so that
+ * reads and writes stay outstanding together, and the oldest,
+ * which is waited for, is the likeliest to have been answered.
+ */
+enum { Free, Reading, Writing };
+
+static int64_t
+copy(IxpCFid *src, IxpCFid *dst, int64_t offset, int64_t len) {
+	Async a[CopyWindow];
+	int64_t off[CopyWindow];
+	int state[CopyWindow], q[CopyWindow];
+	IxpFcall fcall;
+	char err[IXP_ERRMAX];
+	char *buf;
+	int64_t roff, end, ret;
+	long chunk, n;
+	int qh, qn, i, eof, failed;
+
+	chunk = min(src->iounit, dst->iounit);
+	end = len < 0 ? INT64_MAX : offset + len;
+	buf = emalloc(CopyWindow * chunk);
+	for(i=0; i < CopyWindow; i++)
+		state[i] = Free;
+
+	roff = offset;
+	ret = 0;
+	qh = qn = 0;
+	eof = failed = 0;
+	for(;;) {
+		if(!eof && !failed && roff < end && qn < CopyWindow) {
+			for(i=0; state[i] != Free; i++)
+				;
+			n = chunk;
+			if(n > end - roff)
+				n = end - roff;
+			fcall.hdr.type = TRead;
+			fcall.tread.offset = roff;
+			fcall.tread.count = n;
+			a[i].rpc.deadline = deadline(src->timeout);
+			if(!astartin(src->client, &a[i], src->fid, &fcall, buf + i*chunk, n, nil, nil))
+				goto fail;
+			state[i] = Reading;
+			off[i] = roff;
+			roff += n;
+			q[(qh + qn++) % CopyWindow] = i;
+			continue;
+		}
+		if(qn == 0)
+			break;
+		i = q[qh];
+		qh = (qh + 1) % CopyWindow;
+		qn--;
+		n = await(&a[i]);
+		if(state[i] == Writing) {
+			state[i] = Free;
+			if(failed)
+				continue;
+			if(n < 0)
+				goto fail;
+			ret += n;
+			if(n < a[i].count) {
+				werrstr("short write");
+				goto fail;
+			}
+			continue;
+		}
+		state[i] = Free;
+		if(failed || eof)
+			continue;
+		if(n < 0)
+			goto fail;
+		if(n < a[i].count)
+			eof = 1;
+		if(n == 0)
+			continue;
+		fcall.hdr.type = TWrite;
+		fcall.twrite.offset = off[i];
+		fcall.twrite.count = n;
+		fcall.twrite.data = buf + i*chunk;
+		a[i].rpc.deadline = deadline(dst->timeout);
+		if(!astartin(dst->client, &a[i], dst->fid, &fcall, nil, n, nil, nil))
+			goto fail;
+		state[i] = Writing;
+		q[(qh + qn++) % CopyWindow] = i;
+		continue;
+	fail:
+		if(!failed)
+			snprintf(err, sizeof err, "%s", ixp_errbuf());
+		failed = 1;
+	}
+	free(buf);
+	if(failed) {
+		err[sizeof err - 1] = '\0';
+		werrstr("%s", err);
+		return -1;
+	}
+	return ret;
+}
+
+/**
+ * Function: ixp_copy
+ *
+ * Params:
+ *	src:    The file to copy from.
+ *	dst:    The file to copy to.
+ *	offset: The offset at which to begin.
+ *	len:    The number of bytes to copy, or -1 to copy
+ *	        to the end of P<src>.
+ *
+ * Copies P<len> bytes from P<src>, beginning at P<offset>, to
+ * the same offset of P<dst>, which may belong to another
+ * client. Up to 8 buffers of the smaller of the two files'
+ * iounits are kept in flight, each read from P<src> and then
+ * written to P<dst>, so that reads and writes proceed together
+ * without waiting for each other's replies. The copy stops at
+ * the end of P<src>, or at the first error. Like F<ixp_preadv>,
+ * it bypasses the files' read-ahead, write-behind, and data
+ * caches.
+ *
+ * Returns:
+ *	The number of bytes copied, or -1 on failure, in which
+ *	case some of the data may have been written.
+ * See also:
+ *	F<ixp_pread>, F<ixp_pwrite>, F<ixp_preadv>
+ */
+int64_t
+ixp_copy(IxpCFid *src, IxpCFid *dst, int64_t offset, int64_t len) {
+	IxpCFid *f1, *f2;
+	int64_t n;
+
+	/* Lock in a fixed order, lest two copies deadlock. */
+	f1 = src;
+	f2 = dst;
+	if((uintptr_t)f1 > (uintptr_t)f2) {
+		f1 = dst;
+		f2 = src;
+	}
+	thread->lock(&f1->iolock);
+	if(f2 != f1)
+		thread->lock(&f2->iolock);
+
+	dropahead(dst);
+	dst->nseq = 0;
+	if(dst->client->dcache)
+		dcdrop(dst->client->dcache, dst->qid.path);
+	n = -1;
+	if((!(src->behind || src->werror) || syncwrites(src))
+	&& (!(dst->behind || dst->werror) || syncwrites(dst)))
+		n = copy(src, dst, offset, len);
+
+	if(f2 != f1)
+		thread->unlock(&f2->iolock);
+	thread->unlock(&f1->iolock);
+	return n;
+}
+
+/*
+ * Collects the replies to a chain of requests, in order, and
+ * returns the index of the first to fail, or n. Its error is left
+ * in the error buffer.
+ */
+static int
+awaitchain(IxpRpc **r, long *ret, int n) {
+	char err[IXP_ERRMAX];
+	int i, first;
+
+	first = n;
+	for(i=0; i < n; i++) {
+		ret[i] = -1;
+		if(r[i])
+			ret[i] = ixp_await(r[i]);
+		if(ret[i] < 0 && first == n) {
+			first = i;
+			snprintf(err, sizeof err, "%s", ixp_errbuf());
+			err[sizeof err - 1] = '\0';
+		}
+	}
+	if(first < n)
+		werrstr("%s", err);
+	return first;
+}
+
+/* Starts a walk from the root to path on f. */
+static IxpRpc*
+startwalk(IxpClient *c, IxpCFid *f, const char *path) {
+	IxpFcall fcall;
+	IxpRpc *r;
+	char *wname[IXP_MAX_WELEM];
+	char *p;
+	int n;
+
+	p = estrdup(path);
+	n = tokenize(wname, nelem(wname), p, '/');
+	fcall.hdr.type = TWalk;
+	fcall.twalk.newfid = f->fid;
+	fcall.twalk.nwname = n;
+	fcall.twalk.wname = wname;
+	r = astart(c, RootFid, &fcall, &f->qid, n, nil, nil);
+	free(p);
+	return r;
+}
+
+/*
+ * Starts a walk from the root to path on f, followed by an open
+ * with mode, and stores their handles in r.
+ */
+static void
+startopen(IxpClient *c, IxpCFid *f, const char *path, uint8_t mode, IxpRpc **r) {
+	IxpFcall fcall;
+
+	r[0] = startwalk(c, f, path);
+
+	fcall.hdr.type = TOpen;
+	fcall.topen.mode = mode;
+	r[1] = astart(c, f->fid, &fcall, f, 0, nil, nil);
+	f->mode = mode;
+}
+
+static IxpRpc*
+startclunk(IxpClient *c, IxpCFid *f) {
+	IxpFcall fcall;
+
+	fcall.hdr.type = TClunk;
+	return astart(c, f->fid, &fcall, nil, 0, nil, nil);
+}
+
+/**
+ * Function: ixp_readfile
+ * Function: ixp_writefile
+ *
+ * Params:
+ *	path:  The path of the file to read or write.
+ *	buf:   A buffer in which to store the read data, or
+ *	       holding the data to write.
+ *	count: The number of bytes to read or write.
+ *
+ * ixp_readfile reads up to P<count> bytes from the beginning of
+ * the file at P<path>, and ixp_writefile writes P<count> bytes
+ * to the beginning of it, as would F<ixp_open>, F<ixp_read> or
+ * F<ixp_write>, and F<ixp_close>. The requests to walk to, open,
+ * read or write, and clunk the file are sent together, without
+ * waiting for replies in between, so that small files may be
+ * read or written in a single round trip. If any request fails,
+ * the error of the first is reported, and the fid is released.
+ *
+ * Reads of more than one message's worth of data send the
+ * clunk once the rest of the data has been read.
+ *
+ * These functions depend on the server handling requests for a
+ * fid in the order they're sent, as libixp's own server does
+ * when its handlers respond to them immediately.
+ *
+ * Returns:
+ *	The number of bytes read or written, or -1 on failure.
+ * See also:
+ *	F<ixp_open>, F<ixp_read>, F<ixp_write>, F<ixp_close>
+ */
+long
+ixp_readfile(IxpClient *c, const char *path, void *buf, long count) {
+	IxpCFid *f;
+	IxpFcall fcall;
+	IxpRpc *r[4];
+	long ret[4], n, m, want;
+	int nr, err;
+
+	f = getfid(c);
+	startopen(c, f, path, P9_OREAD, r);
+
+	want = min(count, c->msize - 24);
+	fcall.hdr.type = TRead;
+	fcall.tread.offset = 0;
+	fcall.tread.count = want;
+	r[2] = astart(c, f->fid, &fcall, buf, want, nil, nil);
+
+	nr = 3;
+	if(count <= want)
+		r[nr++] = startclunk(c, f);
+
+	err = awaitchain(r, ret, nr);
+	if(err == 0) {
+		/* The walk failed, so the fid was never created. */
+		putfid(f);
+		return -1;
+	}
+	if(nr == 4) {
+		/* The server forgets the fid after any reply to its clunk. */
+		putfid(f);
+		return err < 3 ? -1 : ret[2];
+	}
+
+	if(err < 3) {
+		clunk(f);
+		return -1;
+	}
+	n = ret[2];
+	if(n == want && n < count) {
+		m = fetch(f, (char*)buf + n, count - n, n);
+		if(m < 0)
+			n = -1;
+		else
+			n += m;
+	}
+	if(!clunk(f))
+		return -1;
+	return n;
+}
+
+long
+ixp_writefile(IxpClient *c, const char *path, const void *buf, long count) {
+	IxpCFid *f;
+	IxpFcall fcall;
+	IxpRpc **r;
+	long *ret, len, n;
+	int i, nr, err;
+
+	f = getfid(c);
+	nr = 3 + (count ? (count + c->msize - 25) / (c->msize - 24) : 1);
+	r = emalloc(nr * sizeof *r);
+	ret = emalloc(nr * sizeof *ret);
+
+	startopen(c, f, path, P9_OWRITE, r);
+	len = 0;
+	for(i=2; i < nr-1; i++) {
+		n = min(count - len, c->msize - 24);
+		fcall.hdr.type = TWrite;
+		fcall.twrite.offset = len;
+		fcall.twrite.count = n;
+		fcall.twrite.data = (char*)(uintptr_t)buf + len;
+		r[i] = astart(c, f->fid, &fcall, nil, n, nil, nil);
+		len += n;
+	}
+	r[nr-1] = startclunk(c, f);
+
+	err = awaitchain(r, ret, nr);
+	/* Either the walk failed, or the fid was clunked, even if the
+	 * clunk failed. */
+	putfid(f);
+
+	len = -1;
+	if(err >= nr-1)
+		for(len=0, i=2; i < nr-1; i++)
+			len += ret[i];
+	free(r);
+	free(ret);
+	return len;
+}
+
+/*
+ * A single path's walk, stat and clunk, for ixp_statv.
+ */
+typedef struct StatChain StatChain;
+struct StatChain {
+	IxpCFid*	fid;
+	IxpStat*	stat;
+	IxpRpc*		r[3];
+};
+
+static void
+statstart(IxpClient *c, StatChain *s, const char *path) {
+	IxpFcall fcall;
+
+	s->fid = getfid(c);
+	s->stat = emallocz(sizeof *s->stat);
+	s->r[0] = startwalk(c, s->fid, path);
+	fcall.hdr.type = TStat;
+	s->r[1] = astart(c, s->fid->fid, &fcall, s->stat, 0, nil, nil);
+	s->r[2] = startclunk(c, s->fid);
+}
+
+static IxpStat*
+statfinish(StatChain *s, char **error) {
+	long ret[3];
+	int err;
+
+	err = awaitchain(s->r, ret, 3);
+	/* Either the walk failed, or the fid was clunked, even if the
+	 * clunk failed. */
+	putfid(s->fid);
+	if(err < 2) {
+		if(error)
+			*error = estrdup(ixp_errbuf());
+		ixp_freestat(s->stat);
+		free(s->stat);
+		return nil;
+	}
+	return s->stat;
+}
+
+/**
+ * Function: ixp_statv
+ *
+ * Params:
+ *	paths:  The paths of the files to stat.
+ *	n:      The number of paths.
+ *	stats:  An array in which to store the result for each
+ *	        path.
+ *	errors: An optional array in which to store the error for
+ *	        each path which can't be stat'd.
+ *
+ * Stats each of P<paths>, as F<ixp_stat> would, but without
+ * waiting for each stat before sending the next. The walk,
+ * stat, and clunk for each path are sent together, and up to
+ * the client's P<statwindow> paths (or 32, if it's 0) are in
+ * flight at once. Like F<ixp_readfile>, this depends on the
+ * server handling each fid's requests in order.
+ *
+ * Each element of P<stats> is set to an IxpStat which must be
+ * freed as ixp_stat's result, or to nil if its path couldn't be
+ * stat'd. In that case, if P<errors> is not nil, the same element
+ * of P<errors> is set to a malloc(3) allocated description of the
+ * failure, and otherwise to nil.
+ *
+ * Returns:
+ *	The number of paths successfully stat'd.
+ * See also:
+ *	F<ixp_stat>, F<ixp_readdir>
+ */
+int
+ixp_statv(IxpClient *c, const char *paths[], int n, IxpStat *stats[], char *errors[]) {
+	StatChain *chain;
+	int i, w, nok;
+
+	if(n <= 0)
+		return 0;
+	w = c->statwindow ? c->statwindow : StatWindow;
+	if(w > n)
+		w = n;
+	chain = emalloc(w * sizeof *chain);
+
+	nok = 0;
+	for(i=0; i < n + w; i++) {
+		if(i >= w) {
+			if(errors)
+				errors[i-w] = nil;
+			stats[i-w] = statfinish(&chain[(i-w) % w], errors ? &errors[i-w] : nil);
+			if(stats[i-w])
+				nok++;
+		}
+		if(i < n)
+			statstart(c, &chain[i % w], paths[i]);
+	}
+	free(chain);
+	return nok;
+}
+
+/*
+ * A directory is read into two buffers in turn. As soon as one
+ * is filled, the read for the other is sent, so that the next
+ * batch of entries is on its way while the caller handles this
+ * one.
+ */
+struct IxpDir {
+	IxpCFid*	fid;
+	Async		async;
+	int		busy;	/* A read is outstanding */
+	int		failed;
+	int64_t		offset;	/* The offset of the next read */
+	char*		buf[2];
+	int		cur;	/* The buffer being unpacked */
+	IxpMsg		msg;
+};
+
+static void
+dirread(IxpDir *d) {
+	IxpFcall fcall;
+
+	fcall.hdr.type = TRead;
+	fcall.tread.offset = d->offset;
+	fcall.tread.count = d->fid->iounit;
+	d->async.rpc.deadline = deadline(d->fid->timeout);
+	d->busy = astartin(d->fid->client, &d->async, d->fid->fid, &fcall,
+			   d->buf[!d->cur], d->fid->iounit, nil, nil);
+	if(!d->busy)
+		d->failed = 1;
+}
+
+/*
+ * Unpacks a string in place, by moving it over its length, which
+ * leaves room for its terminator.
+ */
+static void
+dirstring(IxpMsg *m, char **s, int want) {
+	uint16_t len;
+	char *p;
+
+	len = 0;
+	*s = nil;
+	ixp_pu16(m, &len);
+	p = m->pos;
+	m->pos += len;
+	if(m->pos > m->end || !want)
+		return;
+	memmove(p - 2, p, len);
+	p[len - 2] = '\0';
+	*s = p - 2;
+}
+
+static int
+dirstat(IxpMsg *m, IxpStat *s, uint fields) {
+	uint16_t size;
+	char *end;
+
+	size = 0;
+	ixp_pu16(m, &size);
+	end = m->pos + size;
+	if(end > m->end)
+		return 0;
+	ixp_pu16(m, &s->type);
+	ixp_pu32(m, &s->dev);
+	ixp_pqid(m, &s->qid);
+	ixp_pu32(m, &s->mode);
+	ixp_pu32(m, &s->atime);
+	ixp_pu32(m, &s->mtime);
+	ixp_pu64(m, &s->length);
+	dirstring(m, &s->name, fields & IXP_SNAME);
+	dirstring(m, &s->uid, fields & IXP_SUID);
+	dirstring(m, &s->gid, fields & IXP_SGID);
+	dirstring(m, &s->muid, fields & IXP_SMUID);
+	if(m->pos > end)
+		return 0;
+	m->pos = end;
+	return 1;
+}
+
+/**
+ * Function: ixp_opendir
+ * Function: ixp_readdir
+ * Function: ixp_closedir
+ * Type: IxpDir
+ * Type: IxpSField
+ *
+ * Params:
+ *	path:   The path of the directory to list.
+ *	stat:   A structure to fill with the next entry.
+ *	fields: A mask of the T<IxpSField> string members of
+ *	        P<stat> to fill. The rest are set to nil.
+ *
+ * These functions list the directory at P<path> one entry at a
+ * time, using memory proportional only to its iounit, however
+ * many entries it has. ixp_opendir opens the directory and
+ * sends its first read. Each call to ixp_readdir fills P<stat>
+ * with the next entry, and, whenever it moves on to a new batch
+ * of entries, sends the read for the one after.
+ *
+ * The strings in P<stat> point into the T<IxpDir>'s buffers, and
+ * remain valid only until the next call to ixp_readdir or
+ * ixp_closedir. They must not be freed. Strings not requested in
+ * P<fields> are left unpacked.
+ *
+ * Returns:
+ *	ixp_opendir returns a new T<IxpDir>, or nil on failure.
+ *	ixp_readdir returns 1 when P<stat> has been filled, 0 at
+ *	the end of the directory, and -1 on failure.
+ *	ixp_closedir returns 1 on success, and zero on failure.
+ * See also:
+ *	F<ixp_open>, F<ixp_stat>, F<ixp_close>
+ */
+IxpDir*
+ixp_opendir(IxpClient *c, const char *path) {
+	IxpDir *d;
+	IxpCFid *f;
+
+	f = ixp_open(c, path, P9_OREAD);
+	if(f == nil)
+		return nil;
+	if(!(f->qid.type & P9_QTDIR)) {
+		ixp_close(f);
+		werrstr("not a directory");
+		return nil;
+	}
+
+	d = emallocz(sizeof *d + 2 * f->iounit);
+	d->fid = f;
+	d->buf[0] = (char*)&d[1];
+	d->buf[1] = d->buf[0] + f->iounit;
+	d->msg = ixp_message(d->buf[0], 0, MsgUnpack);
+	dirread(d);
+	return d;
+}
+
+int
+ixp_readdir(IxpDir *d, IxpStat *stat, uint fields) {
+	long n;
+
+	while(d->msg.pos >= d->msg.end) {
+		if(d->failed || !d->busy)
+			return d->failed ? -1 : 0;
+		n = await(&d->async);
+		d->busy = 0;
+		if(n <= 0) {
+			d->failed = n < 0;
+			return n;
+		}
+		d->cur = !d->cur;
+		d->msg = ixp_message(d->buf[d->cur], n, MsgUnpack);
+		d->offset += n;
+		dirread(d);
+	}
+	if(!dirstat(&d->msg, stat, fields)) {
+		d->msg.pos = d->msg.end;
+		d->failed = 1;
+		werrstr("received bad directory entry");
+		return -1;
+	}
+	return 1;
+}
+
+int
+ixp_closedir(IxpDir *d) {
+	int ret;
+
+	if(d->busy)
+		await(&d->async);
+	ret = ixp_close(d->fid);
+	free(d);
+	return ret;
+}
+
 /**
  * Function: ixp_print
  * Function: ixp_vprint
@@ -702,3 +2689,308 @@ ixp_print(IxpCFid *fid, const char *fmt, ...) {
 	return n;
 }
 
+
+static long
+afinish(Async *a, IxpFcall *p) {
+	IxpMsg msg;
+	long ret;
+
+	if(p == nil)
+		return -1;
+
+	ret = -1;
+	if(p->hdr.type == RError)
+		werrstr("%s", p->error.ename);
+	else if(p->hdr.type != (a->type^1))
+		werrstr("received mismatched fcall");
+	else switch(p->hdr.type) {
+	case RRead:
+		/* Already in a->buf. */
+		ret = p->rread.count;
+		p->rread.data = nil;
+		break;
+	case RWrite:
+		ret = p->rwrite.count;
+		break;
+	case RWalk:
+		if(p->rwalk.nwqid < a->count) {
+			werrstr("File does not exist");
+			if(p->rwalk.nwqid == 0)
+				werrstr("Protocol botch");
+			break;
+		}
+		if(a->count > 0)
+			*(IxpQid*)a->buf = p->rwalk.wqid[a->count-1];
+		ret = 0;
+		break;
+	case ROpen:
+		initfid(a->buf, p);
+		ret = 0;
+		break;
+	case RClunk:
+		ret = 0;
+		break;
+	case RStat:
+		msg = ixp_message((char*)p->rstat.stat, p->rstat.nstat, MsgUnpack);
+		ixp_pstat(&msg, a->buf);
+		if(msg.pos > msg.end) {
+			werrstr("received bad stat");
+			break;
+		}
+		ret = 0;
+		break;
+	}
+	ixp_freefcall(p);
+	return ret;
+}
+
+static void
+adone(IxpRpc *r) {
+	Async *a;
+
+	a = (Async*)r;
+	a->fn(afinish(a, r->p), a->aux);
+	free(a);
+}
+
+/*
+ * Starts an rpc in a, which the caller owns, and whose
+ * rpc.deadline the caller sets. Unless fn is set, it must be
+ * collected with await. The reply to a TRead is copied straight
+ * into buf.
+ */
+static int
+astartin(IxpClient *c, Async *a, uint32_t fid, IxpFcall *fcall, void *buf, long count, void (*fn)(long, void*), void *aux) {
+	a->type = fcall->hdr.type;
+	a->buf = buf;
+	a->count = count;
+	a->fn = fn;
+	a->aux = aux;
+	a->rpc.done = fn ? adone : nil;
+	a->rpc.rx = &a->fcall;
+	a->rpc.rdata = a->type == TRead ? buf : nil;
+	a->rpc.rmax = count;
+	a->rpc.iov = nil;
+
+	fcall->hdr.fid = fid;
+	return muxrpcstart(c, &a->rpc, fcall) == 0;
+}
+
+static IxpRpc*
+astart(IxpClient *c, uint32_t fid, IxpFcall *fcall, void *buf, long count, void (*fn)(long, void*), void *aux) {
+	Async *a;
+
+	a = emalloc(sizeof *a);
+	a->rpc.deadline = deadline(c->timeout);
+	if(!astartin(c, a, fid, fcall, buf, count, fn, aux)) {
+		free(a);
+		return nil;
+	}
+	/* If fn is set, a may already have been freed. */
+	return &a->rpc;
+}
+
+/* As astart, for a request on f, bounded by f's timeout. */
+static IxpRpc*
+fstart(IxpCFid *f, IxpFcall *fcall, void *buf, long count, void (*fn)(long, void*), void *aux) {
+	Async *a;
+
+	a = emalloc(sizeof *a);
+	a->rpc.deadline = deadline(f->timeout);
+	if(!astartin(f->client, a, f->fid, fcall, buf, count, fn, aux)) {
+		free(a);
+		return nil;
+	}
+	return &a->rpc;
+}
+
+static long
+await(Async *a) {
+	return afinish(a, muxrpcwait(&a->rpc));
+}
+
+/**
+ * Function: ixp_apread
+ * Function: ixp_apwrite
+ * Function: ixp_afstat
+ * Function: ixp_await
+ * Function: ixp_listenclient
+ * Type: IxpRpc
+ *
+ * Params:
+ *	buf:    A buffer in which to store the read data, or
+ *	        holding the data to write.
+ *	count:  The number of bytes to read or write. At most
+ *	        P<fid>->iounit bytes are transferred.
+ *	offset: The offset at which to read or write.
+ *	stat:   A structure to fill with P<fid>'s stat. Its
+ *	        strings must be freed with F<ixp_freestat>.
+ *	fn:     An optional function to call on completion.
+ *	aux:    An arbitrary argument to pass to P<fn>.
+ *
+ * These functions are asynchronous versions of F<ixp_pread>,
+ * F<ixp_pwrite> and F<ixp_fstat>. They send their request and
+ * return immediately, so that a single thread may have any
+ * number of requests outstanding at once.
+ *
+ * If P<fn> is nil, the returned handle must be passed to
+ * ixp_await, which waits for the reply and returns the result
+ * of the request: the number of bytes read or written, 0 for a
+ * successful stat, or -1 on failure. Otherwise, P<fn> is called
+ * with that result and P<aux> as soon as the reply arrives, and
+ * the handle must not be used. It is called by whichever thread
+ * receives the reply, must not block, and may not wait for other
+ * replies from the same client, though it may begin new
+ * requests.
+ *
+ * ixp_listenclient adds P<client>'s connection to P<srv>, so
+ * that replies are received and callbacks run from
+ * F<ixp_serverloop> whenever no other thread is waiting on the
+ * client. The connection must be hung up with F<ixp_hangup>
+ * before the client is unmounted.
+ *
+ * Returns:
+ *	The asynchronous functions return a handle for the new
+ *	request, or nil if it could not be sent.
+ * Bugs:
+ *	In programs without a threading implementation, no more
+ *	requests may be outstanding than the client has tags.
+ * See also:
+ *	F<ixp_pread>, F<ixp_pwrite>, F<ixp_fstat>, F<ixp_listen>
+ */
+IxpRpc*
+ixp_apread(IxpCFid *fid, void *buf, long count, int64_t offset, void (*fn)(long, void*), void *aux) {
+	IxpFcall fcall;
+
+	count = min(count, fid->iounit);
+	fcall.hdr.type = TRead;
+	fcall.tread.offset = offset;
+	fcall.tread.count = count;
+	return fstart(fid, &fcall, buf, count, fn, aux);
+}
+
+IxpRpc*
+ixp_apwrite(IxpCFid *fid, const void *buf, long count, int64_t offset, void (*fn)(long, void*), void *aux) {
+	IxpFcall fcall;
+
+	count = min(count, fid->iounit);
+	fcall.hdr.type = TWrite;
+	fcall.twrite.offset = offset;
+	fcall.twrite.count = count;
+	fcall.twrite.data = (char*)(uintptr_t)buf;
+	return fstart(fid, &fcall, nil, count, fn, aux);
+}
+
+IxpRpc*
+ixp_afstat(IxpCFid *fid, IxpStat *stat, void (*fn)(long, void*), void *aux) {
+	IxpFcall fcall;
+
+	fcall.hdr.type = TStat;
+	return fstart(fid, &fcall, stat, 0, fn, aux);
+}
+
+long
+ixp_await(IxpRpc *rpc) {
+	Async *a;
+	long ret;
+
+	a = (Async*)rpc;
+	ret = await(a);
+	free(a);
+	return ret;
+}
+
+/**
+ * Function: ixp_clientstats
+ * Type: IxpClientStats
+ *
+ * Params:
+ *	stats: A structure to fill with a snapshot of P<client>'s
+ *	       statistics.
+ *
+ * Every client keeps counts of the requests it sends, which
+ * ixp_clientstats copies into P<stats>. P<nrpc> counts the
+ * requests sent, and P<nerror> those which failed to be sent,
+ * timed out, or were answered with an Rerror, each indexed by
+ * (type - P9_TVersion) / 2 for T-message type P<type>.
+ * P<latency> counts, for each type, the round trips which took
+ * less than 1 microsecond in bucket 0, and those which took at
+ * least 2^(n-1) microseconds in bucket n, with the last bucket
+ * holding all longer ones.
+ *
+ * P<sent> and P<received> count bytes on the wire, and remain 0
+ * for clients mounted with F<ixp_mountsrv>. P<inflight> is the
+ * number of requests currently awaiting replies, and
+ * P<maxinflight> the most there have ever been at once.
+ * P<tagwait> counts the requests which had to wait for another's
+ * reply because every tag was in use.
+ *
+ * Latencies include the time spent waiting to send, so comparing
+ * them with the server's own figures separates its slowness from
+ * contention within the client.
+ *
+ * See also:
+ *	F<ixp_mount>
+ */
+void
+ixp_clientstats(IxpClient *client, IxpClientStats *stats) {
+	thread->lock(&client->wlock);
+	thread->lock(&client->lk);
+	*stats = client->stats;
+	stats->inflight = client->nwait;
+	thread->unlock(&client->lk);
+	thread->unlock(&client->wlock);
+}
+
+/**
+ * Function: ixp_clientloop
+ *
+ * Receives and dispatches replies for P<client> until its
+ * connection is lost or it is unmounted. By default, a thread
+ * waiting for a reply reads messages on behalf of all others
+ * until its own arrives, and then hands that role to another
+ * waiting thread. When many threads share a client, running
+ * ixp_clientloop in a thread of its own instead avoids those
+ * handoffs, and wakes each waiting thread only when its reply
+ * arrives. Callbacks passed to F<ixp_apread> and friends are
+ * run by this thread.
+ *
+ * ixp_clientloop requires a threading implementation, and
+ * must return before P<client> is freed: F<ixp_unmount> waits
+ * for it to do so.
+ *
+ * See also:
+ *	F<ixp_pthread_init>, F<ixp_listenclient>, F<ixp_unmount>
+ */
+void
+ixp_clientloop(IxpClient *client) {
+	muxloop(client);
+}
+
+static void
+clientread(IxpConn *c) {
+	if(!muxpoll(c->aux))
+		ixp_hangup(c);
+}
+
+static void
+clientclose(IxpConn *c) {
+	USED(c);
+	/* The fd is a dup; don't shut down the client's socket. */
+}
+
+IxpConn*
+ixp_listenclient(IxpServer *srv, IxpClient *client) {
+	int fd;
+
+	if(client->loop) {
+		werrstr("client has no connection to listen on");
+		return nil;
+	}
+	fd = dup(client->fd);
+	if(fd < 0) {
+		werrstr("dup: %s", strerror(errno));
+		return nil;
+	}
+	return ixp_listen(srv, fd, client, clientread, clientclose);
+}
@@ -104,6 +104,18 @@ ixp_pu64(IxpMsg *msg, uint64_t *val) {
 	*val = vl | ((uint64_t)vb<<32);
 }
 
+/*
+ * Allocates storage for unpacked strings and data: from the
+ * message's arena when it has one, as when the server unpacks a
+ * request into its Ixp9Req, and otherwise with malloc(3).
+ */
+void*
+ixp_unpackalloc(IxpMsg *msg, uint size) {
+	if(msg->arena)
+		return ixp_arenaalloc(msg->arena, size);
+	return emalloc(size);
+}
+
 /**
  * Function: ixp_pstring
  *
@@ -134,7 +146,7 @@ ixp_pstring(IxpMsg *msg, char **s) {
 
 	if(msg->pos + len <= msg->end) {
 		if(msg->mode == MsgUnpack) {
-			*s = emalloc(len + 1);
+			*s = ixp_unpackalloc(msg, len + 1);
 			memcpy(*s, msg->pos, len);
 			(*s)[len] = '\0';
 		}else
@@ -192,7 +204,7 @@ ixp_pstrings(IxpMsg *msg, uint16_t *num, char *strings[], uint max) {
 		}
 		msg->pos = s;
 		size += *num;
-		s = emalloc(size);
+		s = ixp_unpackalloc(msg, size);
 	}
 
 	for(i=0; i < *num; i++) {
@@ -232,7 +244,7 @@ void
 ixp_pdata(IxpMsg *msg, char **data, uint len) {
 	if(msg->pos + len <= msg->end) {
 		if(msg->mode == MsgUnpack) {
-			*data = emalloc(len);
+			*data = ixp_unpackalloc(msg, len);
 			memcpy(*data, msg->pos, len);
 		}else
 			memcpy(msg->pos, *data, len);
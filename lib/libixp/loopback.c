@@ -0,0 +1,280 @@
+/* See LICENSE file for license details. */
+#include <stdlib.h>
+#include <string.h>
+#include "ixp_local.h"
+
+/*
+ * The loopback transport connects an IxpClient directly to an
+ * Ixp9Conn in the same process. Requests are handed to the
+ * server as IxpFcall structures and replies are queued for the
+ * client as such, so no messages are ever packed or unpacked and
+ * no system calls are made.
+ *
+ * Requests are dispatched to the server's handlers in the thread
+ * which sends them. Replies may be sent from any thread, and are
+ * collected by whichever client thread is currently muxing.
+ */
+
+typedef struct Reply Reply;
+
+struct Reply {
+	IxpFcall	fcall; /* Must be first: freed as an IxpFcall* */
+	Reply*		next;
+};
+
+struct IxpLoop {
+	Ixp9Conn*	p9conn;
+	IxpMutex	lk;
+	IxpRendez	r;
+	Reply*		head;
+	Reply*		tail;
+	int		closed;
+};
+
+static char*
+memdup(const void *data, uint len) {
+	char *p;
+
+	p = emalloc(len ? len : 1);
+	memcpy(p, data, len);
+	return p;
+}
+
+static char*
+adup(IxpArena *a, const void *data, uint len) {
+	char *p;
+
+	p = ixp_arenaalloc(a, len);
+	memcpy(p, data, len);
+	return p;
+}
+
+static char*
+astrdup(IxpArena *a, const char *s) {
+	return adup(a, s, strlen(s) + 1);
+}
+
+/*
+ * Copies a client's T-message into a request's arena, as
+ * ixp_msg2fcall would have unpacked it.
+ */
+static void
+dupfcall(Ixp9Req *req, IxpFcall *src) {
+	IxpFcall *dst;
+	IxpArena *a;
+	char *s;
+	uint i, size;
+
+	dst = &req->ifcall;
+	a = &req->arena;
+	dst->hdr = src->hdr;
+
+	switch(src->hdr.type) {
+	default:
+		*dst = *src;
+		break;
+	case TVersion:
+		dst->version.msize = src->version.msize;
+		dst->version.version = astrdup(a, src->version.version);
+		break;
+	case TAuth:
+	case TAttach:
+		dst->tattach.afid = src->tattach.afid;
+		dst->tattach.uname = astrdup(a, src->tattach.uname ? src->tattach.uname : "");
+		dst->tattach.aname = astrdup(a, src->tattach.aname);
+		break;
+	case TOpen:
+		dst->topen.mode = src->topen.mode;
+		break;
+	case TCreate:
+		dst->tcreate.perm = src->tcreate.perm;
+		dst->tcreate.mode = src->tcreate.mode;
+		dst->tcreate.name = astrdup(a, src->tcreate.name);
+		break;
+	case TWalk:
+		dst->twalk.newfid = src->twalk.newfid;
+		dst->twalk.nwname = src->twalk.nwname;
+		dst->twalk.wname = ixp_arenaalloc(a, src->twalk.nwname * sizeof *dst->twalk.wname);
+		size = 1;
+		for(i=0; i < src->twalk.nwname; i++)
+			size += strlen(src->twalk.wname[i]) + 1;
+		s = ixp_arenaalloc(a, size);
+		for(i=0; i < src->twalk.nwname; i++) {
+			dst->twalk.wname[i] = s;
+			size = strlen(src->twalk.wname[i]) + 1;
+			memcpy(s, src->twalk.wname[i], size);
+			s += size;
+		}
+		break;
+	case TWrite:
+		dst->twrite.offset = src->twrite.offset;
+		dst->twrite.count = src->twrite.count;
+		dst->twrite.data = adup(a, src->twrite.data, src->twrite.count);
+		break;
+	case TWStat:
+		dst->twstat.stat = src->twstat.stat;
+		dst->twstat.stat.name = astrdup(a, src->twstat.stat.name);
+		dst->twstat.stat.uid = astrdup(a, src->twstat.stat.uid);
+		dst->twstat.stat.gid = astrdup(a, src->twstat.stat.gid);
+		dst->twstat.stat.muid = astrdup(a, src->twstat.stat.muid);
+		break;
+	}
+}
+
+IxpLoop*
+ixp_loopnew(Ixp9Srv *srv) {
+	IxpLoop *loop;
+
+	loop = emallocz(sizeof *loop);
+	loop->p9conn = ixp_newp9conn(srv);
+	loop->p9conn->loop = loop;
+	thread->initmutex(&loop->lk);
+	loop->r.mutex = &loop->lk;
+	thread->initrendez(&loop->r);
+	return loop;
+}
+
+/* Wakes any thread waiting for a reply and causes it to fail. */
+void
+ixp_loopclose(IxpLoop *loop) {
+	thread->lock(&loop->lk);
+	loop->closed = 1;
+	thread->wakeall(&loop->r);
+	thread->unlock(&loop->lk);
+}
+
+void
+ixp_loopfree(IxpLoop *loop) {
+	Ixp9Conn *p9conn;
+	Reply *r;
+
+	ixp_loopclose(loop);
+
+	p9conn = loop->p9conn;
+	thread->lock(&p9conn->wlock);
+	p9conn->loop = nil;
+	thread->unlock(&p9conn->wlock);
+	ixp_closep9conn(p9conn);
+
+	while((r = loop->head)) {
+		loop->head = r->next;
+		ixp_freefcall(&r->fcall);
+		free(r);
+	}
+	thread->rdestroy(&loop->r);
+	thread->mdestroy(&loop->lk);
+	free(loop);
+}
+
+uint
+ixp_loopsend(IxpLoop *loop, IxpFcall *fcall) {
+	Ixp9Req *req;
+	int closed;
+
+	thread->lock(&loop->lk);
+	closed = loop->closed;
+	thread->unlock(&loop->lk);
+	if(closed) {
+		werrstr("connection closed");
+		return 0;
+	}
+	if(!ixp_admitreq(loop->p9conn, fcall->hdr.type, fcall->hdr.tag))
+		return 1;
+	req = ixp_newreq(loop->p9conn, fcall->hdr.type);
+	dupfcall(req, fcall);
+	ixp_startreq(req);
+	return 1;
+}
+
+/*
+ * Called by ixp_respond with the connection's write lock held.
+ * Ownership of any malloc(3) allocated response data is
+ * transferred to the client, so that it need not be copied.
+ * Data allocated from the request's arena, which is about to be
+ * reset, is copied.
+ */
+void
+ixp_loopreply(IxpLoop *loop, IxpFcall *fcall, IxpArena *arena) {
+	Reply *r;
+
+	r = emallocz(sizeof *r);
+	r->fcall = *fcall;
+	switch(fcall->hdr.type) {
+	case RVersion:
+		r->fcall.version.version = estrdup(fcall->version.version);
+		break;
+	case RError:
+		r->fcall.error.ename = estrdup(fcall->error.ename);
+		break;
+	case RRead:
+		if(ixp_arenaowns(arena, fcall->rread.data))
+			r->fcall.rread.data = memdup(fcall->rread.data, fcall->rread.count);
+		else
+			fcall->rread.data = nil;
+		break;
+	case RWalk:
+		r->fcall.rwalk.wqid = (IxpQid*)memdup(fcall->rwalk.wqid, fcall->rwalk.nwqid * sizeof *fcall->rwalk.wqid);
+		break;
+	case RStat:
+		if(ixp_arenaowns(arena, fcall->rstat.stat))
+			r->fcall.rstat.stat = (uint8_t*)memdup(fcall->rstat.stat, fcall->rstat.nstat);
+		else
+			fcall->rstat.stat = nil;
+		break;
+	}
+
+	thread->lock(&loop->lk);
+	if(loop->tail)
+		loop->tail->next = r;
+	else
+		loop->head = r;
+	loop->tail = r;
+	thread->wake(&loop->r);
+	thread->unlock(&loop->lk);
+}
+
+/*
+ * Waits until a reply is queued or the loop is closed, or until
+ * deadline, as returned by ixp_msec, in which case it returns 0.
+ */
+int
+ixp_loopwait(IxpLoop *loop, uint64_t deadline) {
+	uint64_t now;
+	int ret;
+
+	thread->lock(&loop->lk);
+	while(loop->head == nil && !loop->closed) {
+		now = ixp_msec();
+		if(now >= deadline)
+			break;
+		if(thread->tsleep)
+			thread->tsleep(&loop->r, deadline - now);
+		else
+			thread->sleep(&loop->r);
+	}
+	ret = loop->head || loop->closed;
+	thread->unlock(&loop->lk);
+	return ret;
+}
+
+IxpFcall*
+ixp_looprecv(IxpLoop *loop) {
+	Reply *r;
+
+	thread->lock(&loop->lk);
+	while(loop->head == nil && !loop->closed)
+		thread->sleep(&loop->r);
+	r = loop->head;
+	if(r) {
+		loop->head = r->next;
+		if(loop->head == nil)
+			loop->tail = nil;
+	}
+	thread->unlock(&loop->lk);
+
+	if(r == nil) {
+		werrstr("connection closed");
+		return nil;
+	}
+	return &r->fcall;
+}
@@ -52,6 +52,7 @@ ixp_message(char *data, uint length, uint mode) {
 	m.end = data + length;
 	m.size = length;
 	m.mode = mode;
+	m.arena = nil;
 	return m;
 }
 
@@ -94,6 +95,10 @@ ixp_freefcall(IxpFcall *fcall) {
 		free(fcall->error.ename);
 		fcall->error.ename = nil;
 		break;
+	case RWalk:
+		free(fcall->rwalk.wqid);
+		fcall->rwalk.wqid = nil;
+		break;
 	}
 }
 
@@ -111,6 +116,24 @@ ixp_sizeof_stat(IxpStat *stat) {
 		+ SString(stat->muid);
 }
 
+/*
+ * Allocates storage for the out of line array of a walk message
+ * being unpacked, for the element count at msg->pos, or returns
+ * nil if there are none.
+ */
+static void*
+walkarray(IxpMsg *msg, uint size) {
+	IxpMsg m;
+	uint16_t n;
+
+	m = *msg;
+	n = 0;
+	ixp_pu16(&m, &n);
+	if(m.pos > m.end || n == 0 || n > IXP_MAX_WELEM)
+		return nil;
+	return ixp_unpackalloc(msg, n * size);
+}
+
 void
 ixp_pfcall(IxpMsg *msg, IxpFcall *fcall) {
 	ixp_pu8(msg, &fcall->hdr.type);
@@ -148,10 +171,14 @@ ixp_pfcall(IxpMsg *msg, IxpFcall *fcall) {
 	case TWalk:
 		ixp_pu32(msg, &fcall->hdr.fid);
 		ixp_pu32(msg, &fcall->twalk.newfid);
-		ixp_pstrings(msg, &fcall->twalk.nwname, fcall->twalk.wname, nelem(fcall->twalk.wname));
+		if(msg->mode == MsgUnpack)
+			fcall->twalk.wname = walkarray(msg, sizeof *fcall->twalk.wname);
+		ixp_pstrings(msg, &fcall->twalk.nwname, fcall->twalk.wname, IXP_MAX_WELEM);
 		break;
 	case RWalk:
-		ixp_pqids(msg, &fcall->rwalk.nwqid, fcall->rwalk.wqid, nelem(fcall->rwalk.wqid));
+		if(msg->mode == MsgUnpack)
+			fcall->rwalk.wqid = walkarray(msg, sizeof *fcall->rwalk.wqid);
+		ixp_pqids(msg, &fcall->rwalk.nwqid, fcall->rwalk.wqid, IXP_MAX_WELEM);
 		break;
 	case TOpen:
 		ixp_pu32(msg, &fcall->hdr.fid);
@@ -0,0 +1,80 @@
+/* See LICENSE file for license details. */
+#include <stdlib.h>
+#include "ixp_local.h"
+
+/**
+ * Function: ixp_mountpool
+ * Function: ixp_unmountpool
+ * Function: ixp_poolclient
+ * Type: IxpPool
+ *
+ * Params:
+ *	address: An address (in Plan 9 resource format) at
+ *	         which to connect to a 9P server.
+ *	n:       The number of connections to open.
+ *
+ * ixp_mountpool opens and attaches P<n> separate connections to
+ * the server at P<address>, as would as many calls to
+ * F<ixp_mount>. Each has its own socket, message buffers, and
+ * tags, so that threads using different connections never
+ * contend for the same write lock or muxer.
+ *
+ * ixp_poolclient returns the pool's connections in turn, and
+ * should be called to pick the client for each new, independent
+ * F<ixp_open> or F<ixp_create>. Since each T<IxpCFid> belongs
+ * to the client which opened it, every request made on it goes
+ * over the same connection, in the order it's made. Fids are not
+ * shared between connections, so a file walked or opened on one
+ * can't be used on another.
+ *
+ * ixp_unmountpool unmounts each of the pool's connections and
+ * frees the pool.
+ *
+ * Returns:
+ *	ixp_mountpool returns a new pool, or nil if any of its
+ *	connections could not be made.
+ * See also:
+ *	F<ixp_mount>, F<ixp_open>, F<ixp_clientloop>
+ */
+IxpPool*
+ixp_mountpool(const char *address, int n) {
+	IxpPool *pool;
+
+	if(n < 1) {
+		werrstr("bad number of connections");
+		return nil;
+	}
+
+	pool = emallocz(sizeof *pool);
+	pool->client = emallocz(n * sizeof *pool->client);
+	thread->initmutex(&pool->lk);
+	for(; pool->nclient < n; pool->nclient++) {
+		pool->client[pool->nclient] = ixp_mount(address);
+		if(pool->client[pool->nclient] == nil) {
+			ixp_unmountpool(pool);
+			return nil;
+		}
+	}
+	return pool;
+}
+
+void
+ixp_unmountpool(IxpPool *pool) {
+	uint i;
+
+	for(i=0; i < pool->nclient; i++)
+		ixp_unmount(pool->client[i]);
+	thread->mdestroy(&pool->lk);
+	free(pool->client);
+	free(pool);
+}
+
+IxpClient*
+ixp_poolclient(IxpPool *pool) {
+	IxpClient *c;
+
+	thread->lock(&pool->lk);
+	c = pool->client[pool->next++ % pool->nclient];
+	thread->unlock(&pool->lk);
+	return c;
+}
@@ -2,6 +2,7 @@
  * See LICENSE file for license details.
  */
 #include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,6 +10,7 @@
 #include "ixp_local.h"
 
 static void handlereq(Ixp9Req *r);
+static int shedable(uint8_t type);
 
 /**
  * Variable: ixp_printfcall
@@ -23,6 +25,15 @@ static void handlereq(Ixp9Req *r);
  */
 void (*ixp_printfcall)(IxpFcall*);
 
+enum {
+	/* The number of answered requests of each size which each
+	 * connection keeps for reuse. */
+	ReqCache = 16,
+	/* The size of the arena buffer allocated with requests
+	 * which carry strings or data. */
+	ArenaSize = 256,
+};
+
 static int
 min(int a, int b) {
 	if(a < b)
@@ -31,6 +42,7 @@ min(int a, int b) {
 }
 
 static char
+	Ebusy[] = "server busy",
 	Eduptag[] = "tag in use",
 	Edupfid[] = "fid in use",
 	Enofunc[] = "function not implemented",
@@ -43,33 +55,13 @@ static char
 	Eintr[] = "interrupted",
 	Eisdir[] = "cannot perform operation on a directory";
 
-enum {
-	TAG_BUCKETS = 61,
-	FID_BUCKETS = 61,
-};
-
-struct Ixp9Conn {
-	Map		tagmap;
-	Map		fidmap;
-	MapEnt*		taghash[TAG_BUCKETS];
-	MapEnt*		fidhash[FID_BUCKETS];
-	Ixp9Srv*	srv;
-	IxpConn*	conn;
-	IxpMutex	rlock;
-	IxpMutex	wlock;
-	IxpMsg		rmsg;
-	IxpMsg		wmsg;
-	int		ref;
-};
-
 static void
 decref_p9conn(Ixp9Conn *p9conn) {
-	thread->lock(&p9conn->wlock);
-	if(--p9conn->ref > 0) {
-		thread->unlock(&p9conn->wlock);
+	Ixp9Req *req;
+	int i;
+
+	if(decref(&p9conn->ref) > 0)
 		return;
-	}
-	thread->unlock(&p9conn->wlock);
 
 	assert(p9conn->conn == nil);
 
@@ -79,6 +71,11 @@ decref_p9conn(Ixp9Conn *p9conn) {
 	ixp_mapfree(&p9conn->tagmap, nil);
 	ixp_mapfree(&p9conn->fidmap, nil);
 
+	for(i=0; i < nelem(p9conn->freereq); i++)
+		while((req = p9conn->freereq[i])) {
+			p9conn->freereq[i] = req->next;
+			free(req);
+		}
 	free(p9conn->rmsg.data);
 	free(p9conn->wmsg.data);
 	free(p9conn);
@@ -89,13 +86,14 @@ createfid(Map *map, int fid, Ixp9Conn *p9conn) {
 	IxpFid *f;
 
 	f = emallocz(sizeof *f);
-	p9conn->ref++;
+	incref(&p9conn->ref);
 	f->conn = p9conn;
 	f->fid = fid;
 	f->omode = -1;
 	f->map = map;
 	if(ixp_mapinsert(map, fid, f, false))
 		return f;
+	decref_p9conn(p9conn);
 	free(f);
 	return nil;
 }
@@ -116,40 +114,352 @@ destroyfid(Ixp9Conn *p9conn, ulong fid) {
 	return 1;
 }
 
+/*
+ * Returns whether the first of a connection's deferred requests
+ * may be dispatched: when there's room for it under maxinflight,
+ * or when it's a TClunk or TRemove, which need none. Called with
+ * p9conn->wlock held.
+ */
+static int
+canrun(Ixp9Conn *p9conn) {
+	return p9conn->deferred
+	    && (!shedable(p9conn->deferred->ifcall.hdr.type)
+	     || p9conn->stats.inflight - p9conn->ndeferred < p9conn->srv->maxinflight);
+}
+
+/*
+ * Runs, from the server loop, as many of a connection's deferred
+ * requests as its Ixp9Srv's maxinflight allows, and resumes
+ * reading from it once few enough remain queued.
+ */
+static void
+rundeferred(long id, void *aux) {
+	Ixp9Conn *p9conn;
+	Ixp9Req *req;
+	uint max;
+
+	USED(id);
+	p9conn = aux;
+	max = p9conn->srv->maxinflight;
+	for(;;) {
+		thread->lock(&p9conn->wlock);
+		req = p9conn->deferred;
+		if(canrun(p9conn)) {
+			p9conn->deferred = req->next;
+			p9conn->ndeferred--;
+			req->deferred = 0;
+		}else {
+			req = nil;
+			p9conn->dispatching = 0;
+			if(p9conn->conn && p9conn->ndeferred < max)
+				p9conn->conn->held = 0;
+		}
+		thread->unlock(&p9conn->wlock);
+		if(req == nil)
+			break;
+		handlereq(req);
+	}
+	decref_p9conn(p9conn);
+}
+
+/*
+ * Returns an answered request to its connection's cache, or frees
+ * it, once everything allocated from its arena has been released.
+ * If the connection has requests deferred at its limit of
+ * requests in flight, arranges for the server loop to run them.
+ */
+static void
+freereq(Ixp9Req *req) {
+	Ixp9Conn *p9conn;
+	IxpServer *srv;
+	int i;
+
+	p9conn = req->conn;
+	ixp_arenareset(&req->arena);
+	i = req->arena.size > 0;
+
+	if(shedable(req->ifcall.hdr.type))
+		decref(&p9conn->srv->load);
+	srv = nil;
+	thread->lock(&p9conn->wlock);
+	p9conn->stats.inflight--;
+	if(!p9conn->dispatching && p9conn->conn && canrun(p9conn)) {
+		p9conn->dispatching = 1;
+		srv = p9conn->conn->srv;
+	}
+	if(p9conn->nfree[i] < ReqCache) {
+		req->next = p9conn->freereq[i];
+		p9conn->freereq[i] = req;
+		p9conn->nfree[i]++;
+		req = nil;
+	}
+	thread->unlock(&p9conn->wlock);
+
+	if(srv) {
+		incref(&p9conn->ref);
+		ixp_settimer(srv, 0, rundeferred, p9conn);
+		ixp_wakeserver(srv);
+	}
+	free(req);
+	decref_p9conn(p9conn);
+}
+
+/*
+ * Sends a response to the connection's client. Called with
+ * p9conn->wlock held. Returns 0 if it couldn't be written.
+ */
+static int
+sendfcall(Ixp9Conn *p9conn, IxpFcall *fcall, IxpArena *arena) {
+	uint msize;
+
+	if(p9conn->loop)
+		ixp_loopreply(p9conn->loop, fcall, arena);
+	else if(p9conn->conn) {
+		msize = ixp_fcall2msg(&p9conn->wmsg, fcall);
+		if(ixp_sendmsg(p9conn->conn->fd, &p9conn->wmsg) != msize)
+			return 0;
+	}
+	return 1;
+}
+
 static void
 handlefcall(IxpConn *c) {
-	IxpFcall fcall = {0};
 	Ixp9Conn *p9conn;
 	Ixp9Req *req;
+	uint16_t tag;
+	uint8_t type;
+	uint ok;
 
 	p9conn = c->aux;
 
 	thread->lock(&p9conn->rlock);
-	if(ixp_recvmsg(c->fd, &p9conn->rmsg) == 0)
+	if(ixp_recvmsg(c->fd, &p9conn->rmsg) < 7)
 		goto Fail;
-	if(ixp_msg2fcall(&p9conn->rmsg, &fcall) == 0)
+	type = p9conn->rmsg.data[4];
+	tag = (uint8_t)p9conn->rmsg.data[5] | (uint8_t)p9conn->rmsg.data[6] << 8;
+	if(!ixp_admitreq(p9conn, type, tag)) {
+		thread->unlock(&p9conn->rlock);
+		return;
+	}
+	req = ixp_newreq(p9conn, type);
+	p9conn->rmsg.arena = &req->arena;
+	ok = ixp_msg2fcall(&p9conn->rmsg, &req->ifcall);
+	p9conn->rmsg.arena = nil;
+	if(ok == 0) {
+		freereq(req);
 		goto Fail;
+	}
 	thread->unlock(&p9conn->rlock);
 
-	req = emallocz(sizeof *req);
-	p9conn->ref++;
+	ixp_startreq(req);
+	return;
+
+Fail:
+	thread->unlock(&p9conn->rlock);
+	ixp_hangup(c);
+	return;
+}
+
+/*
+ * Requests which free server state, or which are answered by the
+ * library itself, are never shed, and never wait for room under
+ * maxinflight. A TRemove clunks its fid even when it fails, so it
+ * must reach its handler just as a TClunk.
+ */
+static int
+shedable(uint8_t type) {
+	switch(type) {
+	case TVersion:
+	case TFlush:
+	case TClunk:
+	case TRemove:
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Called before a request is allocated. If the server already
+ * has its Ixp9Srv's maxload requests in flight, answers it at
+ * once with Ebusy, without allocating it or consulting any
+ * handler, and returns 0. Only requests which may be shed count
+ * towards the load, so the flushes and clunks generated when a
+ * connection closes don't.
+ */
+int
+ixp_admitreq(Ixp9Conn *p9conn, uint8_t type, uint16_t tag) {
+	IxpFcall fcall;
+	Ixp9Srv *srv;
+
+	srv = p9conn->srv;
+	if(srv->maxload == 0 || !shedable(type)
+	|| getref(&srv->load) < srv->maxload)
+		return 1;
+
+	memset(&fcall, 0, sizeof fcall);
+	fcall.hdr.type = RError;
+	fcall.hdr.tag = tag;
+	fcall.error.ename = Ebusy;
+	if(ixp_printfcall)
+		ixp_printfcall(&fcall);
+
+	/* On failure, the connection is hung up by its next read. */
+	thread->lock(&p9conn->wlock);
+	p9conn->stats.nbusy++;
+	sendfcall(p9conn, &fcall, nil);
+	thread->unlock(&p9conn->wlock);
+	return 0;
+}
+
+/*
+ * Requests whose messages carry strings or data are allocated
+ * with a buffer for their arena. Others, such as reads, which may
+ * be left pending in their thousands on event files, are kept as
+ * small as possible.
+ */
+static int
+hasarena(uint8_t type) {
+	switch(type) {
+	case TVersion:
+	case TAuth:
+	case TAttach:
+	case TCreate:
+	case TWalk:
+	case TWrite:
+	case TWStat:
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Allocates a new Ixp9Req for a request of the given type on
+ * p9conn, reusing an answered one if possible. Its ifcall is
+ * filled by the caller, with any strings and data allocated from
+ * its arena, before it's passed to ixp_startreq. Used both for
+ * requests read off the wire and for those passed in-process by
+ * the loopback transport.
+ */
+Ixp9Req*
+ixp_newreq(Ixp9Conn *p9conn, uint8_t type) {
+	Ixp9Req *req;
+	int i;
+
+	i = hasarena(type);
+	thread->lock(&p9conn->wlock);
+	req = p9conn->freereq[i];
+	if(req) {
+		p9conn->freereq[i] = req->next;
+		p9conn->nfree[i]--;
+	}
+	p9conn->stats.nreq++;
+	if(++p9conn->stats.inflight > p9conn->stats.maxinflight)
+		p9conn->stats.maxinflight = p9conn->stats.inflight;
+	thread->unlock(&p9conn->wlock);
+	incref(&p9conn->ref);
+	if(shedable(type))
+		incref(&p9conn->srv->load);
+
+	if(req)
+		memset(req, 0, offsetof(Ixp9Req, arena));
+	else {
+		req = emallocz(sizeof *req + i * ArenaSize);
+		ixp_arenainit(&req->arena, i ? (char*)(req + 1) : nil, i * ArenaSize);
+	}
+	/* Overwritten with the same value when ifcall is filled. */
+	req->ifcall.hdr.type = type;
 	req->conn = p9conn;
 	req->srv = p9conn->srv;
-	req->ifcall = fcall;
-	p9conn->conn = c;
+	return req;
+}
+
+/*
+ * Called from the server loop with a request which has just been
+ * read. If its connection already has its Ixp9Srv's maxinflight
+ * requests being handled, or others waiting, queues it to be
+ * dispatched as they're answered, and returns 1. Once as many
+ * are queued as may be handled at once, the connection isn't
+ * read until some have been dispatched. TClunk and TRemove
+ * requests are queued only behind others, so that each fid's
+ * requests are handled in order, and are dispatched as soon as
+ * they reach the head of the queue. TVersion and TFlush requests
+ * are never queued, so that a client at its limit may always
+ * flush its way out of it.
+ */
+static int
+deferreq(Ixp9Req *req) {
+	Ixp9Conn *p9conn;
+	uint8_t type;
+	uint max;
+	int defer;
+
+	p9conn = req->conn;
+	type = req->ifcall.hdr.type;
+	max = p9conn->srv->maxinflight;
+	if(max == 0 || type == TVersion || type == TFlush)
+		return 0;
+
+	thread->lock(&p9conn->wlock);
+	/* The request is already counted in inflight. */
+	defer = p9conn->conn
+	     && (p9conn->deferred
+	      || (shedable(type) && p9conn->stats.inflight - p9conn->ndeferred > max));
+	if(defer) {
+		req->deferred = 1;
+		req->next = nil;
+		if(p9conn->deferred)
+			p9conn->deferredtail->next = req;
+		else
+			p9conn->deferred = req;
+		p9conn->deferredtail = req;
+		p9conn->stats.nheld++;
+		if(++p9conn->ndeferred >= max)
+			p9conn->conn->held = 1;
+	}
+	thread->unlock(&p9conn->wlock);
+	return defer;
+}
+
+/*
+ * Removes a flushed request from its connection's deferred
+ * queue. Returns 0 if it had already been dispatched.
+ */
+static int
+undefer(Ixp9Req *req) {
+	Ixp9Conn *p9conn;
+	Ixp9Req **rp, *prev;
+
+	p9conn = req->conn;
+	thread->lock(&p9conn->wlock);
+	if(!req->deferred) {
+		thread->unlock(&p9conn->wlock);
+		return 0;
+	}
+	prev = nil;
+	for(rp=&p9conn->deferred; *rp != req; rp=&(*rp)->next)
+		prev = *rp;
+	*rp = req->next;
+	if(p9conn->deferredtail == req)
+		p9conn->deferredtail = prev;
+	req->deferred = 0;
+	p9conn->ndeferred--;
+	if(p9conn->conn && p9conn->ndeferred < p9conn->srv->maxinflight)
+		p9conn->conn->held = 0;
+	thread->unlock(&p9conn->wlock);
+	return 1;
+}
+
+/* Dispatches a request to the connection's handlers. */
+void
+ixp_startreq(Ixp9Req *req) {
 
-	if(!ixp_mapinsert(&p9conn->tagmap, fcall.hdr.tag, req, false)) {
+	if(!ixp_mapinsert(&req->conn->tagmap, req->ifcall.hdr.tag, req, false)) {
 		ixp_respond(req, Eduptag);
 		return;
 	}
 
-	handlereq(req);
-	return;
-
-Fail:
-	thread->unlock(&p9conn->rlock);
-	ixp_hangup(c);
-	return;
+	if(!deferreq(req))
+		handlereq(req);
 }
 
 static void
@@ -201,6 +511,11 @@ handlereq(Ixp9Req *r) {
 			ixp_respond(r, Enotag);
 			return;
 		}
+		/* ixp_respond answers the flushed request. */
+		if(undefer(r->oldreq)) {
+			ixp_respond(r, nil);
+			return;
+		}
 		if(!srv->flush) {
 			ixp_respond(r, Enofunc);
 			return;
@@ -299,6 +614,7 @@ handlereq(Ixp9Req *r) {
 			}
 		}else
 			r->newfid = r->fid;
+		r->ofcall.rwalk.wqid = ixp_reqalloc(r, r->ifcall.twalk.nwname * sizeof *r->ofcall.rwalk.wqid);
 		if(!p9conn->srv->walk) {
 			ixp_respond(r, Enofunc);
 			return;
@@ -371,6 +687,7 @@ handlereq(Ixp9Req *r) {
 void
 ixp_respond(Ixp9Req *req, const char *error) {
 	Ixp9Conn *p9conn;
+	IxpConn *c;
 	int msize;
 
 	p9conn = req->conn;
@@ -382,7 +699,6 @@ ixp_respond(Ixp9Req *req, const char *error) {
 		break;
 	case TVersion:
 		assert(error == nil);
-		free(req->ifcall.version.version);
 
 		thread->lock(&p9conn->rlock);
 		thread->lock(&p9conn->wlock);
@@ -396,10 +712,8 @@ ixp_respond(Ixp9Req *req, const char *error) {
 		req->ofcall.version.msize = msize;
 		break;
 	case TAttach:
-		if(error)
+		if(error && req->fid)
 			destroyfid(p9conn, req->fid->fid);
-		free(req->ifcall.tattach.uname);
-		free(req->ifcall.tattach.aname);
 		break;
 	case TOpen:
 	case TCreate:
@@ -409,7 +723,6 @@ ixp_respond(Ixp9Req *req, const char *error) {
 			req->fid->omode = req->ifcall.topen.mode;
 			req->fid->qid = req->ofcall.ropen.qid;
 		}
-		free(req->ifcall.tcreate.name);
 		break;
 	case TWalk:
 		if(error || req->ofcall.rwalk.nwqid < req->ifcall.twalk.nwname) {
@@ -423,10 +736,6 @@ ixp_respond(Ixp9Req *req, const char *error) {
 			else
 				req->newfid->qid = req->ofcall.rwalk.wqid[req->ofcall.rwalk.nwqid-1];
 		}
-		free(*req->ifcall.twalk.wname);
-		break;
-	case TWrite:
-		free(req->ifcall.twrite.data);
 		break;
 	case TRemove:
 		if(req->fid)
@@ -440,12 +749,11 @@ ixp_respond(Ixp9Req *req, const char *error) {
 		if((req->oldreq = ixp_mapget(&p9conn->tagmap, req->ifcall.tflush.oldtag)))
 			ixp_respond(req->oldreq, Eintr);
 		break;
-	case TWStat:
-		ixp_freestat(&req->ifcall.twstat.stat);
-		break;
 	case TRead:
 	case TStat:
-		break;		
+	case TWrite:
+	case TWStat:
+		break;
 	/* Still to be implemented: auth */
 	}
 
@@ -463,24 +771,50 @@ ixp_respond(Ixp9Req *req, const char *error) {
 
 	ixp_maprm(&p9conn->tagmap, req->ifcall.hdr.tag);;
 
-	if(p9conn->conn) {
-		thread->lock(&p9conn->wlock);
-		msize = ixp_fcall2msg(&p9conn->wmsg, &req->ofcall);
-		if(ixp_sendmsg(p9conn->conn->fd, &p9conn->wmsg) != msize)
-			ixp_hangup(p9conn->conn);
-		thread->unlock(&p9conn->wlock);
+	/* The connection is detached under the lock, so that only one
+	 * thread hangs it up, but hung up after, since closing it
+	 * flushes and clunks through ixp_newreq, which takes it. */
+	c = nil;
+	thread->lock(&p9conn->wlock);
+	if(!sendfcall(p9conn, &req->ofcall, &req->arena)) {
+		c = p9conn->conn;
+		p9conn->conn = nil;
 	}
+	thread->unlock(&p9conn->wlock);
+	if(c)
+		ixp_hangup(c);
 
 	switch(req->ofcall.hdr.type) {
 	case RStat:
-		free(req->ofcall.rstat.stat);
+		if(!ixp_arenaowns(&req->arena, req->ofcall.rstat.stat))
+			free(req->ofcall.rstat.stat);
 		break;
 	case RRead:
-		free(req->ofcall.rread.data);
+		if(!ixp_arenaowns(&req->arena, req->ofcall.rread.data))
+			free(req->ofcall.rread.data);
 		break;
 	}
-	free(req);
-	decref_p9conn(p9conn);
+	freereq(req);
+}
+
+/**
+ * Function: ixp_reqalloc
+ *
+ * Allocates P<size> bytes of storage which live as long as
+ * P<req>, and are released all at once when it is answered by
+ * F<ixp_respond>. The strings and data of P<req>->P<ifcall> are
+ * allocated in the same way. Handlers may use it for the
+ * P<data> of an RRead or the P<stat> of an RStat response, which
+ * ixp_respond otherwise expects to be malloc(3) allocated and
+ * frees, as well as for any scratch space they need until they
+ * respond.
+ *
+ * See also:
+ *	F<ixp_respond>, T<Ixp9Req>
+ */
+void*
+ixp_reqalloc(Ixp9Req *req, uint size) {
+	return ixp_arenaalloc(&req->arena, size);
 }
 
 /* Flush a pending request */
@@ -491,13 +825,11 @@ voidrequest(void *context, void *arg) {
 
 	orig_req = arg;
 	conn = orig_req->conn;
-	conn->ref++;
 
-	flush_req = emallocz(sizeof *orig_req);
+	flush_req = ixp_newreq(conn, TFlush);
 	flush_req->ifcall.hdr.type = TFlush;
 	flush_req->ifcall.hdr.tag = IXP_NOTAG;
 	flush_req->ifcall.tflush.oldtag = orig_req->ifcall.hdr.tag;
-	flush_req->conn = conn;
 
 	flush_req->aux = *(void**)context;
 	*(void**)context = flush_req;
@@ -512,14 +844,12 @@ voidfid(void *context, void *arg) {
 
 	fid = arg;
 	p9conn = fid->conn;
-	p9conn->ref++;
 
-	clunk_req = emallocz(sizeof *clunk_req);
+	clunk_req = ixp_newreq(p9conn, TClunk);
 	clunk_req->ifcall.hdr.type = TClunk;
 	clunk_req->ifcall.hdr.tag = IXP_NOTAG;
 	clunk_req->ifcall.hdr.fid = fid->fid;
 	clunk_req->fid = fid;
-	clunk_req->conn = p9conn;
 
 	clunk_req->aux = *(void**)context;
 	*(void**)context = clunk_req;
@@ -527,13 +857,25 @@ voidfid(void *context, void *arg) {
 
 static void
 cleanupconn(IxpConn *c) {
-	Ixp9Conn *p9conn;
+	ixp_closep9conn(c->aux);
+}
+
+/*
+ * Detaches a connection from its transport, flushes any pending
+ * requests, clunks any open fids, and drops the transport's
+ * reference.
+ */
+void
+ixp_closep9conn(Ixp9Conn *p9conn) {
 	Ixp9Req *req, *r;
 
-	p9conn = c->aux;
+	/* Responders look at the connection under the write lock,
+	 * and it's freed once this returns. */
+	thread->lock(&p9conn->wlock);
 	p9conn->conn = nil;
+	thread->unlock(&p9conn->wlock);
 	req = nil;
-	if(p9conn->ref > 1) {
+	if(getref(&p9conn->ref) > 1) {
 		ixp_mapexec(&p9conn->fidmap, voidfid, &req);
 		ixp_mapexec(&p9conn->tagmap, voidrequest, &req);
 	}
@@ -567,8 +909,39 @@ cleanupconn(IxpConn *c) {
  * the P<freefid> member is called to perform any necessary cleanup
  * and to free any associated resources.
  *
+ * The strings and data in a request's P<ifcall> belong to the
+ * request, and are valid only until it is answered. Handlers
+ * must copy anything they need to keep, and must not free or
+ * reallocate them.
+ *
+ * If the P<maxinflight> member is non-zero, no connection may
+ * have more than that many requests passed to handlers and
+ * awaiting responses. Requests beyond the limit are queued, and
+ * passed on as earlier ones are answered or flushed. Once as
+ * many are queued, the server stops reading from the connection,
+ * so that the client is held back by its own socket buffers
+ * rather than starving other clients. TClunk and TRemove
+ * requests wait only behind others already queued, so that each
+ * fid's requests are handled in order. TVersion and TFlush
+ * requests are never queued, so a client at its limit may always
+ * flush a request it has given up on. Clients which
+ * leave requests pending, such as reads of event files, need a
+ * limit well above the number they keep outstanding.
+ *
+ * If the P<maxload> member is non-zero, it limits the number of
+ * requests awaiting responses across all of the server's
+ * connections. Beyond it, new requests are answered at once with
+ * the error "server busy", before any handler sees them, so that
+ * a burst costs the server no more than the replies. TVersion,
+ * TFlush, TClunk and TRemove requests, which release state
+ * rather than consume it, are always admitted, and don't count
+ * towards the limit. Reads left pending on event files do count,
+ * so servers with many idle readers need a limit well above the
+ * number of them, or every other request will be refused.
+ *
  * See also:
- *	F<ixp_listen>, F<ixp_respond>, F<ixp_printfcall>,
+ *	F<ixp_listen>, F<ixp_respond>, F<ixp_printfcall>, F<ixp_reqalloc>,
+ *	F<ixp_connstats>,
  *	F<IxpFcall>, F<IxpFid>
  */
 void
@@ -580,9 +953,53 @@ ixp_serve9conn(IxpConn *c) {
 	if(fd < 0)
 		return;
 
+	p9conn = ixp_newp9conn(c->aux);
+	p9conn->conn = ixp_listen(c->srv, fd, p9conn, handlefcall, cleanupconn);
+}
+
+/**
+ * Function: ixp_connstats
+ * Type: Ixp9ConnStats
+ *
+ * Params:
+ *	stats: A structure to fill with a snapshot of P<c>'s
+ *	       statistics.
+ *
+ * If P<c> is a 9P connection accepted by F<ixp_serve9conn>,
+ * ixp_connstats copies its statistics into P<stats>. P<nreq>
+ * counts the requests it has received, P<inflight> is the
+ * number currently awaiting responses, and P<maxinflight> the
+ * most there have ever been at once. P<nheld> counts the
+ * requests queued at the limit set by the Ixp9Srv's
+ * P<maxinflight>, and P<nbusy> the requests refused
+ * at its P<maxload>. A server may walk the P<conn> list
+ * of its T<IxpServer> to gather the figures for every client.
+ *
+ * Returns:
+ *	Returns 1 if P<c> is a 9P connection, and 0 otherwise.
+ * See also:
+ *	F<ixp_serve9conn>, F<ixp_clientstats>
+ */
+int
+ixp_connstats(IxpConn *c, Ixp9ConnStats *stats) {
+	Ixp9Conn *p9conn;
+
+	if(c->read != handlefcall)
+		return 0;
+	p9conn = c->aux;
+	thread->lock(&p9conn->wlock);
+	*stats = p9conn->stats;
+	thread->unlock(&p9conn->wlock);
+	return 1;
+}
+
+Ixp9Conn*
+ixp_newp9conn(Ixp9Srv *srv) {
+	Ixp9Conn *p9conn;
+
 	p9conn = emallocz(sizeof *p9conn);
-	p9conn->ref++;
-	p9conn->srv = c->aux;
+	p9conn->ref = 1;
+	p9conn->srv = srv;
 	p9conn->rmsg.size = 1024;
 	p9conn->wmsg.size = 1024;
 	p9conn->rmsg.data = emalloc(p9conn->rmsg.size);
@@ -592,6 +1009,5 @@ ixp_serve9conn(IxpConn *c) {
 	ixp_mapinit(&p9conn->fidmap, p9conn->fidhash, nelem(p9conn->fidhash));
 	thread->initmutex(&p9conn->rlock);
 	thread->initmutex(&p9conn->wlock);
-
-	ixp_listen(c->srv, fd, p9conn, handlefcall, cleanupconn);
+	return p9conn;
 }
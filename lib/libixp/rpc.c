@@ -3,6 +3,7 @@
  * Distributed under the same terms as libixp.
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,6 +13,10 @@ static int gettag(IxpClient*, IxpRpc*);
 static void puttag(IxpClient*, IxpRpc*);
 static void enqueue(IxpClient*, IxpRpc*);
 static void dequeue(IxpClient*, IxpRpc*);
+static void failasync(IxpClient*);
+static IxpFcall* waitrpc(IxpRpc*);
+
+#define RPCINDEX(type) (((type) - TVersion) / 2)
 
 void
 muxinit(IxpClient *mux)
@@ -23,16 +28,31 @@ muxinit(IxpClient *mux)
 	thread->initmutex(&mux->rlock);
 	thread->initmutex(&mux->wlock);
 	thread->initrendez(&mux->tagrend);
+	mux->sleep.r.mutex = &mux->lk;
+	thread->initrendez(&mux->sleep.r);
 }
 
 void
 muxfree(IxpClient *mux)
 {
+	int i;
+
+	/* Free any abandoned rpcs still holding tags. */
+	thread->lock(&mux->lk);
+	failasync(mux);
+	thread->unlock(&mux->lk);
+
 	thread->mdestroy(&mux->lk);
 	thread->mdestroy(&mux->rlock);
 	thread->mdestroy(&mux->wlock);
 	thread->rdestroy(&mux->tagrend);
+	thread->rdestroy(&mux->sleep.r);
+	for(i=0; i < mux->mwait; i++)
+		if(mux->rendez[i].aux)
+			thread->rdestroy(&mux->rendez[i]);
 	free(mux->wait);
+	free(mux->freetag);
+	free(mux->rendez);
 }
 
 static void
@@ -40,15 +60,82 @@ initrpc(IxpClient *mux, IxpRpc *r)
 {
 	r->mux = mux;
 	r->waiting = 1;
-	r->r.mutex = &mux->lk;
+	r->async = 0;
 	r->p = nil;
-	thread->initrendez(&r->r);
 }
 
+/*
+ * Copies n bytes between buf and the iovecs at r->iov, starting
+ * r->iovoff bytes into them: into buf if out is set, and out of
+ * it otherwise.
+ */
 static void
-freemuxrpc(IxpRpc *r)
+iovcopy(IxpRpc *r, char *buf, uint n, int out)
+{
+	const struct iovec *v;
+	size_t off, k;
+
+	v = r->iov;
+	off = r->iovoff;
+	while(n > 0) {
+		if(off >= v->iov_len) {
+			off -= v->iov_len;
+			v++;
+			continue;
+		}
+		k = v->iov_len - off;
+		if(k > n)
+			k = n;
+		if(out)
+			memcpy(buf, (char*)v->iov_base + off, k);
+		else
+			memcpy((char*)v->iov_base + off, buf, k);
+		buf += k;
+		n -= k;
+		off += k;
+	}
+}
+
+/*
+ * Packs a TWrite whose data is gathered from r->iov straight
+ * into m, as ixp_fcall2msg would.
+ */
+static int
+packwritev(IxpMsg *m, IxpFcall *f, IxpRpc *r)
+{
+	uint32_t size;
+
+	size = 4 + 1 + 2 + 4 + 8 + 4 + f->twrite.count;
+	if(size > m->size)
+		return 0;
+	m->pos = m->data;
+	m->end = m->data + size;
+	m->mode = MsgPack;
+	ixp_pu32(m, &size);
+	ixp_pu8(m, &f->hdr.type);
+	ixp_pu16(m, &f->hdr.tag);
+	ixp_pu32(m, &f->hdr.fid);
+	ixp_pu64(m, &f->twrite.offset);
+	ixp_pu32(m, &f->twrite.count);
+	iovcopy(r, m->pos, f->twrite.count, 1);
+	m->pos = m->data;
+	return size;
+}
+
+/* As ixp_loopsend, for a TWrite gathered from r->iov. */
+static uint
+loopsendv(IxpLoop *loop, IxpFcall *f, IxpRpc *r)
 {
-	thread->rdestroy(&r->r);
+	char *data;
+	uint ret;
+
+	data = emalloc(f->twrite.count ? f->twrite.count : 1);
+	iovcopy(r, data, f->twrite.count, 1);
+	f->twrite.data = data;
+	ret = ixp_loopsend(loop, f);
+	f->twrite.data = nil;
+	free(data);
+	return ret;
 }
 
 static int
@@ -57,72 +144,246 @@ sendrpc(IxpRpc *r, IxpFcall *f)
 	int ret;
 	IxpClient *mux;
 	
-	ret = 0;
 	mux = r->mux;
 	/* assign the tag, add selves to response queue */
 	thread->lock(&mux->lk);
 	r->tag = gettag(mux, r);
+	r->type = f->hdr.type;
+	/*
+	 * A clunk or remove frees its fid whether or not it
+	 * succeeds, so neither may be abandoned.
+	 */
+	if(r->type == TClunk || r->type == TRemove)
+		r->deadline = 0;
+	r->start = ixp_nsec();
+	if(RPCINDEX(r->type) < IXP_NRPC)
+		mux->stats.nrpc[RPCINDEX(r->type)]++;
 	f->hdr.tag = r->tag;
 	enqueue(mux, r);
 	thread->unlock(&mux->lk);
 
-	thread->lock(&mux->wlock);
-	if(!ixp_fcall2msg(&mux->wmsg, f) || !ixp_sendmsg(mux->fd, &mux->wmsg)) {
+	/*
+	 * The loopback transport runs the server's handler in this
+	 * thread, so it mustn't hold the write lock, lest a slow
+	 * handler hold up other senders, or one which uses this
+	 * client deadlock.
+	 */
+	if(mux->loop && r->iov && r->type == TWrite)
+		ret = loopsendv(mux->loop, f, r);
+	else if(mux->loop)
+		ret = ixp_loopsend(mux->loop, f);
+	else {
+		thread->lock(&mux->wlock);
+		if(r->iov && r->type == TWrite)
+			ret = packwritev(&mux->wmsg, f, r);
+		else
+			ret = ixp_fcall2msg(&mux->wmsg, f);
+		ret = ret && ixp_sendmsg(mux->fd, &mux->wmsg);
+		if(ret)
+			mux->stats.sent += mux->wmsg.end - mux->wmsg.data;
+		thread->unlock(&mux->wlock);
+	}
+	if(ret == 0) {
 		/* werrstr("settag/send tag %d: %r", tag); fprint(2, "%r\n"); */
 		thread->lock(&mux->lk);
+		if(RPCINDEX(r->type) < IXP_NRPC)
+			mux->stats.nerror[RPCINDEX(r->type)]++;
 		dequeue(mux, r);
 		puttag(mux, r);
 		thread->unlock(&mux->lk);
-		ret = -1;
 	}
-	thread->unlock(&mux->wlock);
-	return ret;
+	return ret ? 0 : -1;
 }
 
-static IxpFcall*
-muxrecv(IxpClient *mux)
+/* Called with mux->lk held. */
+static IxpRpc*
+lookup(IxpClient *mux, int tag)
+{
+	IxpRpc *r;
+
+	tag -= mux->mintag;
+	if(tag < 0 || tag >= mux->mwait) {
+		fprintf(stderr, "libixp: received unfeasible tag: %d (min: %d, max: %d)\n", tag+mux->mintag, mux->mintag, mux->mintag+mux->mwait);
+		return nil;
+	}
+	r = mux->wait[tag];
+	if(r == nil || r->prev == nil) {
+		fprintf(stderr, "libixp: received message with bad tag\n");
+		return nil;
+	}
+	return r;
+}
+
+static void
+toobig(IxpFcall *f)
+{
+	f->hdr.type = RError;
+	f->error.ename = estrdup("received too much data");
+}
+
+/*
+ * Unpacks the message in m into r->rx. The data of an RRead
+ * is copied straight to r->rdata, or scattered to r->iov, when
+ * either is set, so that reads need not allocate anything.
+ */
+static int
+unpack(IxpRpc *r, IxpMsg *m)
 {
 	IxpFcall *f;
 
-	f = nil;
-	thread->lock(&mux->rlock);
-	if(ixp_recvmsg(mux->fd, &mux->rmsg) == 0)
-		goto fail;
-	f = emallocz(sizeof *f);
-	if(ixp_msg2fcall(&mux->rmsg, f) == 0) {
-		free(f);
-		f = nil;
+	f = r->rx;
+	if(m->data[4] != RRead || (r->rdata == nil && r->iov == nil))
+		return ixp_msg2fcall(m, f);
+
+	m->pos = m->data + 4;
+	m->mode = MsgUnpack;
+	ixp_pu8(m, &f->hdr.type);
+	ixp_pu16(m, &f->hdr.tag);
+	ixp_pu32(m, &f->rread.count);
+	if(m->pos + f->rread.count > m->end)
+		return 0;
+	if(f->rread.count > r->rmax)
+		toobig(f);
+	else if(r->iov) {
+		iovcopy(r, m->pos, f->rread.count, 0);
+		f->rread.data = nil;
+	}else {
+		memcpy(r->rdata, m->pos, f->rread.count);
+		f->rread.data = r->rdata;
 	}
-fail:
-	thread->unlock(&mux->rlock);
-	return f;
+	return 1;
 }
 
+/* As unpack, for a reply from the loopback transport. */
 static void
-dispatchandqlock(IxpClient *mux, IxpFcall *f)
+loopunpack(IxpRpc *r, IxpFcall *p)
 {
-	int tag;
-	IxpRpc *r2;
+	IxpFcall *f;
 
-	tag = f->hdr.tag - mux->mintag;
-	thread->lock(&mux->lk);
-	/* hand packet to correct sleeper */
-	if(tag < 0 || tag >= mux->mwait) {
-		fprintf(stderr, "libixp: received unfeasible tag: %d (min: %d, max: %d)\n", f->hdr.tag, mux->mintag, mux->mintag+mux->mwait);
-		goto fail;
+	f = r->rx;
+	*f = *p;
+	if(p->hdr.type != RRead || (r->rdata == nil && r->iov == nil))
+		return;
+	if(p->rread.count > r->rmax)
+		toobig(f);
+	else if(r->iov) {
+		iovcopy(r, p->rread.data, p->rread.count, 0);
+		f->rread.data = nil;
+	}else {
+		memcpy(r->rdata, p->rread.data, p->rread.count);
+		f->rread.data = r->rdata;
 	}
-	r2 = mux->wait[tag];
-	if(r2 == nil || r2->prev == nil) {
-		fprintf(stderr, "libixp: received message with bad tag\n");
-		goto fail;
+	free(p->rread.data);
+}
+
+/*
+ * Records the reply to r, of n bytes on the wire, in the client's
+ * stats. Latencies are counted in buckets of powers of two
+ * microseconds. Called with mux->lk held.
+ */
+static void
+account(IxpClient *mux, IxpRpc *r, uint n)
+{
+	uint64_t us;
+	int i, b;
+
+	mux->stats.received += n;
+	if(r == nil)
+		return;
+	i = RPCINDEX(r->type);
+	if(i >= IXP_NRPC)
+		return;
+	if(r->rx->hdr.type == RError)
+		mux->stats.nerror[i]++;
+	us = (ixp_nsec() - r->start) / 1000;
+	for(b=0; us && b < IXP_NLAT-1; b++)
+		us >>= 1;
+	mux->stats.latency[i][b]++;
+}
+
+/*
+ * Receives a message and unpacks it into the storage of the rpc
+ * it answers, which is then dequeued and woken. Returns 0 on eof.
+ * Otherwise, returns 1 with mux->lk held, and *rp set to the rpc,
+ * or nil if the message's tag was bad.
+ */
+static int
+muxrecv(IxpClient *mux, IxpRpc **rp)
+{
+	IxpFcall *p;
+	IxpRpc *r;
+	uint n;
+	int ok;
+
+	if(mux->loop) {
+		p = ixp_looprecv(mux->loop);
+		if(p == nil)
+			return 0;
+		thread->lock(&mux->lk);
+		r = lookup(mux, p->hdr.tag);
+		if(r)
+			loopunpack(r, p);
+		else
+			ixp_freefcall(p);
+		free(p);
+		account(mux, r, 0);
+	}else {
+		thread->lock(&mux->rlock);
+		n = ixp_recvmsg(mux->fd, &mux->rmsg);
+		if(n == 0) {
+			thread->unlock(&mux->rlock);
+			return 0;
+		}
+		thread->lock(&mux->lk);
+		/* The tag follows the size and type. */
+		r = lookup(mux, (uint8_t)mux->rmsg.data[5] | (uint8_t)mux->rmsg.data[6]<<8);
+		ok = r == nil || unpack(r, &mux->rmsg);
+		thread->unlock(&mux->rlock);
+		if(!ok) {
+			thread->unlock(&mux->lk);
+			return 0;
+		}
+		account(mux, r, n);
+	}
+
+	if(r) {
+		r->p = r->rx;
+		dequeue(mux, r);
+		thread->wake(&r->r);
+	}
+	*rp = r;
+	return 1;
+}
+
+/*
+ * Runs the completion function of an rpc which nobody will wait
+ * for. Called, and returns, with mux->lk held, but drops it in
+ * between so that the function may start new rpcs.
+ */
+static void
+complete(IxpClient *mux, IxpRpc *r)
+{
+	puttag(mux, r);
+	thread->unlock(&mux->lk);
+	r->done(r);
+	thread->lock(&mux->lk);
+}
+
+/* The connection is dead; fail any rpcs that nobody will wait for. */
+static void
+failasync(IxpClient *mux)
+{
+	IxpRpc *r, *next;
+
+	for(r=mux->sleep.next; r != &mux->sleep; r = next) {
+		next = r->next;
+		if(r->async && r->done) {
+			dequeue(mux, r);
+			werrstr("unexpected eof");
+			complete(mux, r);
+			next = mux->sleep.next;
+		}
 	}
-	r2->p = f;
-	dequeue(mux, r2);
-	thread->wake(&r2->r);
-	return;
-fail:
-	ixp_freefcall(f);
-	free(f);
 }
 
 static void
@@ -130,6 +391,13 @@ electmuxer(IxpClient *mux)
 {
 	IxpRpc *rpc;
 
+	/* a receive loop is waiting to take over */
+	if(mux->recvloop){
+		mux->muxer = nil;
+		thread->wake(&mux->sleep.r);
+		return;
+	}
+
 	/* if there is anyone else sleeping, wake them to mux */
 	for(rpc=mux->sleep.next; rpc != &mux->sleep; rpc = rpc->next){
 		if(!rpc->async){
@@ -141,46 +409,323 @@ electmuxer(IxpClient *mux)
 	mux->muxer = nil;
 }
 
-IxpFcall*
-muxrpc(IxpClient *mux, IxpFcall *tx)
+/*
+ * Sleeps on r until woken, unless deadline has passed, in which
+ * case it returns 0.
+ */
+static int
+sleepuntil(IxpRendez *r, uint64_t deadline)
 {
-	IxpRpc r;
-	IxpFcall *p;
+	uint64_t now;
 
-	initrpc(mux, &r);
-	if(sendrpc(&r, tx) < 0)
-		return nil;
+	now = ixp_msec();
+	if(now >= deadline)
+		return 0;
+	if(thread->tsleep)
+		thread->tsleep(r, deadline - now);
+	else
+		thread->sleep(r);
+	return 1;
+}
+
+/*
+ * Waits until a message can be received without blocking, or
+ * returns 0 if deadline passes first. Called only by the muxer.
+ */
+static int
+muxready(IxpClient *mux, uint64_t deadline)
+{
+	fd_set rfd;
+	timeval tv;
+	uint64_t now;
+	int n;
+
+	if(mux->loop)
+		return ixp_loopwait(mux->loop, deadline);
+	for(;;) {
+		now = ixp_msec();
+		if(now > deadline)
+			now = deadline;
+		tv.tv_sec = (deadline - now) / 1000;
+		tv.tv_usec = (deadline - now) % 1000 * 1000;
+		FD_ZERO(&rfd);
+		FD_SET(mux->fd, &rfd);
+		n = thread->select(mux->fd+1, &rfd, nil, nil, &tv);
+		if(n == 0)
+			return 0;
+		/* Let any error be reported by the read. */
+		if(n > 0 || errno != EINTR)
+			return 1;
+	}
+}
+
+/*
+ * Holds the tag of an rpc abandoned without an Rflush, until its
+ * reply arrives.
+ */
+typedef struct Orphan Orphan;
+struct Orphan {
+	IxpRpc		rpc;
+	IxpFcall	fcall;
+};
+
+static void
+orphandone(IxpRpc *r)
+{
+	if(r->p)
+		ixp_freefcall(r->p);
+	free(r);
+}
+
+static void
+orphan(IxpClient *mux, IxpRpc *r)
+{
+	Orphan *o;
+
+	o = emallocz(sizeof *o);
+	o->rpc.mux = mux;
+	o->rpc.async = 1;
+	o->rpc.done = orphandone;
+	o->rpc.rx = &o->fcall;
+	o->rpc.tag = r->tag;
+	o->rpc.type = r->type;
+	o->rpc.start = r->start;
+	o->rpc.r = r->r;
+	mux->wait[r->tag - mux->mintag] = &o->rpc;
+	dequeue(mux, r);
+	enqueue(mux, &o->rpc);
+}
+
+/*
+ * Called with mux->lk held, and returns with it held, once r's
+ * deadline has passed. Flushes r, and waits for the Rflush, which
+ * the protocol requires before its tag may be reused. r stays
+ * queued until then, so a reply which arrives first is still
+ * unpacked into r->rx, and is returned, since the request took
+ * effect, unless it's an error, which is likely the server's
+ * reaction to the flush. If the server answers the flush with
+ * an error instead, the tag is held by an orphan until the
+ * reply arrives.
+ */
+static IxpFcall*
+cancel(IxpRpc *r)
+{
+	IxpClient *mux;
+	IxpRpc fr;
+	IxpFcall f, *p;
+	int refused;
+
+	mux = r->mux;
+	/* Not to be elected muxer, nor completed by one. */
+	r->async = 1;
+	thread->unlock(&mux->lk);
+
+	f.hdr.type = TFlush;
+	f.tflush.oldtag = r->tag;
+	initrpc(mux, &fr);
+	fr.done = nil;
+	fr.rx = &f;
+	fr.rdata = nil;
+	fr.rmax = 0;
+	fr.iov = nil;
+	fr.deadline = 0;
+	refused = 0;
+	if(sendrpc(&fr, &f) == 0 && waitrpc(&fr)) {
+		refused = f.hdr.type != RFlush;
+		ixp_freefcall(&f);
+	}
 
 	thread->lock(&mux->lk);
+	p = r->p;
+	if(p == nil && RPCINDEX(r->type) < IXP_NRPC)
+		mux->stats.nerror[RPCINDEX(r->type)]++;
+	if(p && p->hdr.type == RError) {
+		ixp_freefcall(p);
+		p = nil;
+	}
+	if(p == nil) {
+		werrstr("timed out");
+		if(r->prev && refused) {
+			orphan(mux, r);
+			return nil;
+		}
+		if(r->prev)
+			dequeue(mux, r);
+	}
+	puttag(mux, r);
+	return p;
+}
+
+static IxpFcall*
+waitrpc(IxpRpc *r)
+{
+	IxpClient *mux;
+	IxpRpc *r2;
+	IxpFcall *p;
+	int timedout;
+
+	mux = r->mux;
+	timedout = 0;
+	thread->lock(&mux->lk);
+	r->async = 0;
 	/* wait for our packet */
-	while(mux->muxer && mux->muxer != &r && !r.p)
-		thread->sleep(&r.r);
+	while(mux->muxer && mux->muxer != r && !r->p) {
+		if(r->deadline == 0)
+			thread->sleep(&r->r);
+		else if(!sleepuntil(&r->r, r->deadline)) {
+			timedout = 1;
+			break;
+		}
+	}
 
 	/* if not done, there's no muxer; start muxing */
-	if(!r.p){
-		assert(mux->muxer == nil || mux->muxer == &r);
-		mux->muxer = &r;
-		while(!r.p){
+	if(!r->p && !timedout){
+		assert(mux->muxer == nil || mux->muxer == r);
+		mux->muxer = r;
+		while(!r->p){
 			thread->unlock(&mux->lk);
-			p = muxrecv(mux);
-			if(p == nil){
+			if(r->deadline && !muxready(mux, r->deadline)) {
+				thread->lock(&mux->lk);
+				/* pass the buck before flushing */
+				r->async = 1;
+				timedout = 1;
+				break;
+			}
+			if(!muxrecv(mux, &r2)){
 				/* eof -- just give up and pass the buck */
 				thread->lock(&mux->lk);
-				dequeue(mux, &r);
+				dequeue(mux, r);
+				failasync(mux);
 				break;
 			}
-			dispatchandqlock(mux, p);
+			if(r2 && r2 != r && r2->async && r2->done)
+				complete(mux, r2);
 		}
 		electmuxer(mux);
 	}
-	p = r.p;
-	puttag(mux, &r);
+	if(timedout) {
+		p = cancel(r);
+		thread->unlock(&mux->lk);
+		return p;
+	}
+	p = r->p;
+	puttag(mux, r);
 	thread->unlock(&mux->lk);
 	if(p == nil)
 		werrstr("unexpected eof");
 	return p;
 }
 
+/*
+ * Sends tx and unpacks the reply into the same structure, with
+ * the data of an RRead copied to rdata, if it's not nil. If
+ * deadline is nonzero and passes, as returned by ixp_msec,
+ * before the reply arrives, the request is flushed and nil is
+ * returned.
+ */
+IxpFcall*
+muxrpc(IxpClient *mux, IxpFcall *tx, char *rdata, uint64_t deadline)
+{
+	IxpRpc r;
+
+	initrpc(mux, &r);
+	r.done = nil;
+	r.deadline = deadline;
+	r.rx = tx;
+	r.rdata = rdata;
+	r.rmax = rdata ? tx->tread.count : 0;
+	r.iov = nil;
+	if(sendrpc(&r, tx) < 0)
+		return nil;
+	return waitrpc(&r);
+}
+
+/*
+ * Sends tx without waiting for a reply, which is unpacked into
+ * r->rx, and r->rdata or r->iov, as by muxrpc, and waited for
+ * until r->deadline, all of which the caller sets. The data of a
+ * TWrite is gathered from r->iov, if it's set. The reply must later be
+ * collected with muxrpcwait, unless r->done is set, in which case
+ * it is called by whichever thread receives the reply, with r->p
+ * set (nil if the connection was lost), and must not block.
+ */
+int
+muxrpcstart(IxpClient *mux, IxpRpc *r, IxpFcall *tx)
+{
+	initrpc(mux, r);
+	r->async = 1;
+	return sendrpc(r, tx);
+}
+
+IxpFcall*
+muxrpcwait(IxpRpc *r)
+{
+	assert(r->done == nil);
+	return waitrpc(r);
+}
+
+/*
+ * Receives and dispatches a single message, unless another thread
+ * is already doing so. Intended to be called when mux->fd is
+ * readable. Returns 0 on eof.
+ */
+int
+muxpoll(IxpClient *mux)
+{
+	IxpRpc *r;
+	int ok;
+
+	thread->lock(&mux->lk);
+	if(mux->muxer) {
+		thread->unlock(&mux->lk);
+		return 1;
+	}
+	mux->muxer = &mux->sleep;
+	thread->unlock(&mux->lk);
+
+	ok = muxrecv(mux, &r);
+	if(!ok) {
+		thread->lock(&mux->lk);
+		failasync(mux);
+	}else if(r && r->async && r->done)
+		complete(mux, r);
+	electmuxer(mux);
+	thread->unlock(&mux->lk);
+	return ok;
+}
+
+/*
+ * Receives and dispatches messages until eof, in place of the
+ * elected muxer. Each reply wakes only the thread waiting for it.
+ * Any thread muxing when the loop starts hands over to it when
+ * its own reply arrives.
+ */
+void
+muxloop(IxpClient *mux)
+{
+	IxpRpc *r;
+
+	thread->lock(&mux->lk);
+	mux->recvloop = 1;
+	while(mux->muxer)
+		thread->sleep(&mux->sleep.r);
+	mux->muxer = &mux->sleep;
+	for(;;){
+		thread->unlock(&mux->lk);
+		if(!muxrecv(mux, &r)){
+			thread->lock(&mux->lk);
+			failasync(mux);
+			break;
+		}
+		if(r && r->async && r->done)
+			complete(mux, r);
+	}
+	mux->recvloop = 0;
+	electmuxer(mux);
+	thread->wakeall(&mux->tagrend);
+	thread->unlock(&mux->lk);
+}
+
 static void
 enqueue(IxpClient *mux, IxpRpc *r)
 {
@@ -199,50 +744,70 @@ dequeue(IxpClient *mux, IxpRpc *r)
 	r->next = nil;
 }
 
-static int 
+/*
+ * Free tags are kept on a stack in mux->freetag, which holds
+ * mux->mwait - mux->nwait entries, so that getting and putting a
+ * tag take constant time. The tag space grows by doubling, up to
+ * maxtag-mintag tags. Each tag keeps its own rendezvous, which an
+ * rpc borrows while it holds the tag, so that none need be
+ * created for each rpc.
+ */
+static int
 gettag(IxpClient *mux, IxpRpc *r)
 {
 	int i, mw;
 	IxpRpc **w;
+	IxpRendez *rz;
+	uint16_t *f;
 
-	for(;;){
-		/* wait for a free tag */
-		while(mux->nwait == mux->mwait){
-			if(mux->mwait < mux->maxtag-mux->mintag){
-				mw = mux->mwait;
-				if(mw == 0)
-					mw = 1;
-				else
-					mw <<= 1;
-				w = realloc(mux->wait, mw * sizeof *w);
-				if(w == nil)
-					return -1;
-				memset(w+mux->mwait, 0, (mw-mux->mwait) * sizeof *w);
-				mux->wait = w;
-				mux->freetag = mux->mwait;
-				mux->mwait = mw;
-				break;
-			}
-			thread->sleep(&mux->tagrend);
+	/* wait for a free tag */
+	if(mux->nwait == mux->maxtag-mux->mintag)
+		mux->stats.tagwait++;
+	while(mux->nwait == mux->mwait){
+		if(mux->mwait < mux->maxtag-mux->mintag){
+			mw = mux->mwait;
+			if(mw == 0)
+				mw = 1;
+			else
+				mw <<= 1;
+			if(mw > mux->maxtag-mux->mintag)
+				mw = mux->maxtag-mux->mintag;
+			w = realloc(mux->wait, mw * sizeof *w);
+			if(w == nil)
+				return -1;
+			mux->wait = w;
+			f = realloc(mux->freetag, mw * sizeof *f);
+			if(f == nil)
+				return -1;
+			mux->freetag = f;
+			rz = realloc(mux->rendez, mw * sizeof *rz);
+			if(rz == nil)
+				return -1;
+			mux->rendez = rz;
+			memset(w+mux->mwait, 0, (mw-mux->mwait) * sizeof *w);
+			memset(rz+mux->mwait, 0, (mw-mux->mwait) * sizeof *rz);
+			/* push the new tags, lowest on top */
+			for(i=0; i < mw-mux->mwait; i++)
+				f[i] = mw-1 - i;
+			mux->mwait = mw;
+			break;
 		}
-
-		i=mux->freetag;
-		if(mux->wait[i] == 0)
-			goto Found;
-		for(; i<mux->mwait; i++)
-			if(mux->wait[i] == 0)
-				goto Found;
-		for(i=0; i<mux->freetag; i++)
-			if(mux->wait[i] == 0)
-				goto Found;
-		/* should not fall out of while without free tag */
-		abort();
+		thread->sleep(&mux->tagrend);
 	}
 
-Found:
+	i = mux->freetag[mux->mwait - mux->nwait - 1];
+	assert(mux->wait[i] == nil);
 	mux->nwait++;
+	if(mux->nwait > mux->stats.maxinflight)
+		mux->stats.maxinflight = mux->nwait;
 	mux->wait[i] = r;
 	r->tag = i+mux->mintag;
+	rz = &mux->rendez[i];
+	if(rz->aux == nil) {
+		rz->mutex = &mux->lk;
+		thread->initrendez(rz);
+	}
+	r->r = *rz;
 	return r->tag;
 }
 
@@ -254,9 +819,7 @@ puttag(IxpClient *mux, IxpRpc *r)
 	i = r->tag - mux->mintag;
 	assert(mux->wait[i] == r);
 	mux->wait[i] = nil;
+	mux->freetag[mux->mwait - mux->nwait] = i;
 	mux->nwait--;
-	mux->freetag = i;
 	thread->wake(&mux->tagrend);
-	freemuxrpc(r);
 }
-
@@ -4,6 +4,7 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -96,22 +97,75 @@ ixp_server_close(IxpServer *s) {
 	}
 }
 
+/*
+ * Wakes the server loop from select, so that it runs a timer set
+ * from another thread. May be called from any thread.
+ */
+void
+ixp_wakeserver(IxpServer *s) {
+	int n;
+
+	/* If the pipe is full, a wakeup is already pending. */
+	thread->lock(&s->lk);
+	if(s->running) {
+		n = write(s->wake[1], "", 1);
+		USED(n);
+	}
+	thread->unlock(&s->lk);
+}
+
+static int
+initwake(IxpServer *s) {
+	int i;
+
+	if(pipe(s->wake) < 0)
+		return -1;
+	for(i=0; i < 2; i++) {
+		fcntl(s->wake[i], F_SETFL, fcntl(s->wake[i], F_GETFL) | O_NONBLOCK);
+		fcntl(s->wake[i], F_SETFD, FD_CLOEXEC);
+	}
+	return 0;
+}
+
 static void
 prepare_select(IxpServer *s) {
 	IxpConn *c;
 
 	FD_ZERO(&s->rd);
+	FD_SET(s->wake[0], &s->rd);
+	if(s->maxfd < s->wake[0])
+		s->maxfd = s->wake[0];
 	for(c = s->conn; c; c = c->next)
-		if(c->read) {
+		if(c->read && !c->held) {
 			if(s->maxfd < c->fd)
 				s->maxfd = c->fd;
 			FD_SET(c->fd, &s->rd);
 		}
 }
 
+/*
+ * Reads once from each ready connection, starting each time with
+ * the one after the last round's first, so that none is always
+ * served ahead of the others.
+ */
 static void
 handle_conns(IxpServer *s) {
 	IxpConn *c, *n;
+	char buf[64];
+
+	if(FD_ISSET(s->wake[0], &s->rd))
+		while(read(s->wake[0], buf, sizeof buf) > 0)
+			;
+
+	c = s->conn;
+	if(c && c->next) {
+		s->conn = c->next;
+		for(n = s->conn; n->next; n = n->next)
+			;
+		n->next = c;
+		c->next = nil;
+	}
+
 	for(c = s->conn; c; c = n) {
 		n = c->next;
 		if(FD_ISSET(c->fd, &s->rd))
@@ -127,6 +181,13 @@ handle_conns(IxpServer *s) {
  * P<srv>->running becomes false, or when select(2) returns an
  * error other than EINTR.
  *
+ * Each time round the loop, a single message is read from every
+ * connection which has one waiting, in an order which rotates
+ * from one round to the next, so that a busy client can't starve
+ * the others. Connections with as many requests queued as their
+ * Ixp9Srv's P<maxinflight> allows are not read at all until
+ * some have been passed to its handlers.
+ *
  * Returns:
  *	Returns 0 when the loop exits normally, and 1 when
  *	it exits on error. V<errno> or the return value of
@@ -142,8 +203,10 @@ ixp_serverloop(IxpServer *srv) {
 	long timeout;
 	int r;
 
-	srv->running = 1;
+	if(initwake(srv) < 0)
+		return 1;
 	thread->initmutex(&srv->lk);
+	srv->running = 1;
 	while(srv->running) {
 		tvp = nil;
 		timeout = ixp_nexttimer(srv);
@@ -164,10 +227,18 @@ ixp_serverloop(IxpServer *srv) {
 		if(r < 0) {
 			if(errno == EINTR)
 				continue;
-			return 1;
+			r = 1;
+			goto Exit;
 		}
 		handle_conns(srv);
 	}
-	return 0;
+	r = 0;
+Exit:
+	thread->lock(&srv->lk);
+	srv->running = 0;
+	close(srv->wake[0]);
+	close(srv->wake[1]);
+	thread->unlock(&srv->lk);
+	return r;
 }
 
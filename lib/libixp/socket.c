@@ -2,10 +2,15 @@
  * Copyright ©2004-2006 Anselm R. Garbe <garbeam at gmail dot com>
  * See LICENSE file for license details.
  */
+#define _DEFAULT_SOURCE /* SO_REUSEPORT, TCP_KEEPIDLE */
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -22,13 +27,37 @@
  */
 
 /* From FreeBSD's sys/su.h */
+#ifndef SUN_LEN
 #define SUN_LEN(su) \
 	(sizeof(*(su)) - sizeof((su)->sun_path) + strlen((su)->sun_path))
+#endif
 
 typedef struct addrinfo addrinfo;
 typedef struct sockaddr sockaddr;
 typedef struct sockaddr_un sockaddr_un;
 typedef struct sockaddr_in sockaddr_in;
+typedef struct sockopts sockopts;
+
+enum {
+	/* Connections awaiting a Fast Open handshake, by default. */
+	FastOpenQueue = 16,
+};
+
+/* Options which may follow the port in a TCP address. */
+struct sockopts {
+	int	nodelay;
+	int	sndbuf;
+	int	rcvbuf;
+	int	keepalive; /* Idle time, in seconds. */
+	int	reuseport;
+	int	fastopen;  /* Queue length, when announcing. */
+	int	timeout;   /* Connect timeout, in milliseconds. */
+};
+
+/* Nagle's algorithm does nothing but delay small 9P messages. */
+static const sockopts defopts = {
+	.nodelay = 1,
+};
 
 static char*
 get_port(char *addr) {
@@ -48,6 +77,128 @@ get_port(char *addr) {
 	return s;
 }
 
+static int
+get_opts(char *port, sockopts *o) {
+	static const struct {
+		char*	name;
+		int	offset;
+		int	def;
+	} tab[] = {
+		{"nodelay",	offsetof(sockopts, nodelay),	1},
+		{"sndbuf",	offsetof(sockopts, sndbuf),	0},
+		{"rcvbuf",	offsetof(sockopts, rcvbuf),	0},
+		{"keepalive",	offsetof(sockopts, keepalive),	60},
+		{"reuseport",	offsetof(sockopts, reuseport),	1},
+		{"fastopen",	offsetof(sockopts, fastopen),	FastOpenQueue},
+		{"timeout",	offsetof(sockopts, timeout),	0},
+	};
+	char *opts, *opt, *val, *end;
+	long n;
+	int i;
+
+	*o = defopts;
+
+	/* Truncates port at '!' */
+	opts = strchr(port, '!');
+	if(opts == nil)
+		return 0;
+	*opts++ = '\0';
+
+	while((opt = opts)) {
+		opts = strchr(opt, '!');
+		if(opts)
+			*opts++ = '\0';
+
+		val = strchr(opt, '=');
+		if(val)
+			*val++ = '\0';
+
+		for(i=0; i < nelem(tab); i++)
+			if(!strcmp(tab[i].name, opt))
+				break;
+		if(i == nelem(tab)) {
+			werrstr("unknown socket option: %s", opt);
+			return -1;
+		}
+
+		n = tab[i].def;
+		if(val) {
+			n = strtol(val, &end, 0);
+			if(*val == '\0' || *end != '\0' || n < 0 || n > INT_MAX) {
+				werrstr("bad value for socket option: %s", opt);
+				return -1;
+			}
+		}
+		else if(n == 0) {
+			werrstr("socket option requires a value: %s", opt);
+			return -1;
+		}
+		*(int*)((char*)o + tab[i].offset) = n;
+	}
+	return 0;
+}
+
+static int
+setopt(int fd, int level, int name, int val, char *desc) {
+	if(setsockopt(fd, level, name, (void*)&val, sizeof val) < 0) {
+		werrstr("setsockopt %s: %s", desc, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Options which must be set before connect(2) or listen(2). Those
+ * set on a listening socket are inherited by the connections
+ * accepted from it.
+ */
+static int
+set_opts(int fd, sockopts *o, int announce) {
+	if(setopt(fd, IPPROTO_TCP, TCP_NODELAY, !!o->nodelay, "nodelay"))
+		return -1;
+	if(o->sndbuf && setopt(fd, SOL_SOCKET, SO_SNDBUF, o->sndbuf, "sndbuf"))
+		return -1;
+	if(o->rcvbuf && setopt(fd, SOL_SOCKET, SO_RCVBUF, o->rcvbuf, "rcvbuf"))
+		return -1;
+	if(o->keepalive) {
+		if(setopt(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "keepalive"))
+			return -1;
+#ifdef TCP_KEEPIDLE
+		if(setopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, o->keepalive, "keepalive"))
+			return -1;
+#endif
+	}
+	if(o->reuseport) {
+#ifdef SO_REUSEPORT
+		if(setopt(fd, SOL_SOCKET, SO_REUSEPORT, 1, "reuseport"))
+			return -1;
+#else
+		werrstr("reuseport: not supported on this system");
+		return -1;
+#endif
+	}
+	if(o->fastopen) {
+		if(announce) {
+#ifdef TCP_FASTOPEN
+			if(setopt(fd, IPPROTO_TCP, TCP_FASTOPEN, o->fastopen, "fastopen"))
+				return -1;
+#else
+			werrstr("fastopen: not supported on this system");
+			return -1;
+#endif
+		}else {
+#ifdef TCP_FASTOPEN_CONNECT
+			if(setopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "fastopen"))
+				return -1;
+#else
+			werrstr("fastopen: not supported on this system");
+			return -1;
+#endif
+		}
+	}
+	return 0;
+}
+
 static int
 sock_unix(char *address, sockaddr_un *sa, socklen_t *salen) {
 	int fd;
@@ -113,7 +264,7 @@ fail:
 }
 
 static addrinfo*
-alookup(char *host, int announce) {
+alookup(char *host, int announce, sockopts *o) {
 	addrinfo hints, *ret;
 	char *port;
 	int err;
@@ -122,9 +273,11 @@ alookup(char *host, int announce) {
 	port = get_port(host);
 	if(port == nil)
 		return nil;
+	if(get_opts(port, o))
+		return nil;
 
 	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET;
+	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 
 	if(announce) {
@@ -146,31 +299,183 @@ ai_socket(addrinfo *ai) {
 	return socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
 }
 
+/*
+ * Orders the addresses so that address families alternate,
+ * beginning with the resolver's preferred family, as recommended
+ * by RFC 8305.
+ */
+static addrinfo**
+interleave(addrinfo *aip, int *np) {
+	addrinfo **ret, *ai;
+	int i, j, n, fam;
+
+	n = 0;
+	for(ai = aip; ai; ai = ai->ai_next)
+		n++;
+	ret = emallocz(n * sizeof *ret);
+
+	fam = aip->ai_family;
+	for(i = 0; i < n; i++) {
+		for(ai = aip; ai; ai = ai->ai_next) {
+			for(j = 0; j < i; j++)
+				if(ret[j] == ai)
+					break;
+			if(j < i)
+				continue;
+			if(ret[i] == nil)
+				ret[i] = ai;
+			if(ai->ai_family == fam) {
+				ret[i] = ai;
+				break;
+			}
+		}
+		fam = (ret[i]->ai_family == AF_INET6) ? AF_INET : AF_INET6;
+	}
+	*np = n;
+	return ret;
+}
+
 static int
-dial_tcp(char *host) {
-	addrinfo *ai, *aip;
-	int fd;
+setnonblock(int fd, int on) {
+	int fl;
 
-	aip = alookup(host, 0);
+	fl = fcntl(fd, F_GETFL);
+	if(fl < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, on ? fl|O_NONBLOCK : fl&~O_NONBLOCK);
+}
+
+/*
+ * Dials each address in turn, without waiting for earlier attempts
+ * to fail before starting the next after Stagger ms. The first
+ * connection to succeed is returned and the rest are abandoned.
+ */
+static int
+dial_tcp(char *host) {
+	enum { Stagger = 250 }; /* RFC 8305 Connection Attempt Delay */
+	addrinfo *ai, *aip, **addrs;
+	fd_set wr;
+	timeval tv;
+	sockopts o;
+	uint64_t now, last, deadline;
+	long wait;
+	socklen_t len;
+	int *fds, fd, err, i, n, next, npending, maxfd;
+
+	aip = alookup(host, 0, &o);
 	if(aip == nil)
 		return -1;
 
-	SET(fd);
-	for(ai = aip; ai; ai = ai->ai_next) {
-		fd = ai_socket(ai);
-		if(fd == -1) {
-			werrstr("socket: %s", strerror(errno));
-			continue;
+	addrs = interleave(aip, &n);
+	fds = emalloc(n * sizeof *fds);
+
+	fd = -1;
+	next = 0;
+	npending = 0;
+	last = 0;
+	deadline = 0;
+	if(o.timeout)
+		deadline = ixp_msec() + o.timeout;
+	werrstr("connect: no addresses");
+
+	for(;;) {
+		now = ixp_msec();
+		if(deadline && now >= deadline) {
+			werrstr("connect: timed out");
+			break;
 		}
 
-		if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+		if(next < n && (npending == 0 || now - last >= Stagger)) {
+			ai = addrs[next];
+			fds[next] = ai_socket(ai);
+			i = next++;
+			last = now;
+			if(fds[i] == -1) {
+				werrstr("socket: %s", strerror(errno));
+				continue;
+			}
+			if(set_opts(fds[i], &o, 0) || setnonblock(fds[i], 1)) {
+				close(fds[i]);
+				fds[i] = -1;
+				break;
+			}
+			if(connect(fds[i], ai->ai_addr, ai->ai_addrlen) == 0) {
+				fd = fds[i];
+				fds[i] = -1;
+				break;
+			}
+			if(errno != EINPROGRESS) {
+				werrstr("connect: %s", strerror(errno));
+				close(fds[i]);
+				fds[i] = -1;
+				continue;
+			}
+			npending++;
+		}
+		if(npending == 0) {
+			if(next < n)
+				continue;
 			break;
+		}
 
-		werrstr("connect: %s", strerror(errno));
+		FD_ZERO(&wr);
+		maxfd = 0;
+		for(i = 0; i < next; i++)
+			if(fds[i] != -1) {
+				FD_SET(fds[i], &wr);
+				if(fds[i] > maxfd)
+					maxfd = fds[i];
+			}
+
+		wait = -1;
+		if(next < n)
+			wait = Stagger - (long)(now - last);
+		if(deadline && (wait < 0 || wait > deadline - now))
+			wait = deadline - now;
+		if(wait >= 0) {
+			tv.tv_sec = wait / 1000;
+			tv.tv_usec = wait % 1000 * 1000;
+		}
+		if(thread->select(maxfd + 1, nil, &wr, nil, wait >= 0 ? &tv : nil) < 0) {
+			if(errno == EINTR)
+				continue;
+			werrstr("select: %s", strerror(errno));
+			break;
+		}
+
+		for(i = 0; i < next && fd == -1; i++) {
+			if(fds[i] == -1 || !FD_ISSET(fds[i], &wr))
+				continue;
+			len = sizeof err;
+			if(getsockopt(fds[i], SOL_SOCKET, SO_ERROR, (void*)&err, &len) < 0)
+				err = errno;
+			if(err == 0) {
+				fd = fds[i];
+				fds[i] = -1;
+			}else {
+				werrstr("connect: %s", strerror(err));
+				close(fds[i]);
+				fds[i] = -1;
+				/* Don't wait out the delay after a failure. */
+				last = 0;
+			}
+			npending--;
+		}
+		if(fd != -1)
+			break;
+	}
+
+	for(i = 0; i < next; i++)
+		if(fds[i] != -1)
+			close(fds[i]);
+	if(fd != -1 && setnonblock(fd, 0)) {
+		werrstr("fcntl: %s", strerror(errno));
 		close(fd);
 		fd = -1;
 	}
 
+	free(fds);
+	free(addrs);
 	freeaddrinfo(aip);
 	return fd;
 }
@@ -178,9 +483,10 @@ dial_tcp(char *host) {
 static int
 announce_tcp(char *host) {
 	addrinfo *ai, *aip;
+	sockopts o;
 	int fd;
 
-	aip = alookup(host, 1);
+	aip = alookup(host, 1, &o);
 	if(aip == nil)
 		return -1;
 
@@ -191,6 +497,9 @@ announce_tcp(char *host) {
 		if(fd == -1)
 			continue;
 
+		if(set_opts(fd, &o, 1))
+			goto fail;
+
 		if(bind(fd, ai->ai_addr, ai->ai_addrlen) < 0)
 			goto fail;
 
@@ -254,12 +563,38 @@ lookup(const char *address, addrtab *tab) {
  *	address: An address on which to connect or listen,
  *		 specified in the Plan 9 resources
  *		 specification format
- *		 (<protocol>!address[!<port>])
+ *		 (<protocol>!address[!<port>[!<option>...]])
  *
  * These functions hide some of the ugliness of Berkely
  * Sockets. ixp_dial connects to the resource at P<address>,
  * while ixp_announce begins listening on P<address>.
  *
+ * TCP addresses may be followed by any number of socket
+ * options, each of the form I<name> or I<name>=I<value>:
+ *
+ *	nodelay:   Disable Nagle's algorithm. On by default;
+ *	           nodelay=0 re-enables it.
+ *	sndbuf:    Set SO_SNDBUF to I<value> bytes.
+ *	rcvbuf:    Set SO_RCVBUF to I<value> bytes.
+ *	keepalive: Send keepalive probes after I<value>
+ *	           (default 60) seconds of idleness.
+ *	reuseport: Set SO_REUSEPORT.
+ *	fastopen:  Use TCP Fast Open. When announcing, I<value>
+ *	           (default 16) sets the length of the pending
+ *	           queue.
+ *	timeout:   Give up dialing after I<value> milliseconds.
+ *
+ * Hosts may resolve to any number of IPv4 and IPv6 addresses.
+ * ixp_dial tries them with alternating address families, and
+ * starts each new attempt 250ms after the last without
+ * abandoning it, as described in RFC 8305. The first connection
+ * established is returned. IPv6 literals need no quoting, as in
+ * tcp!::1!564.
+ *
+ * For instance, tcp!localhost!564!rcvbuf=262144!keepalive.
+ * Options set when announcing are inherited by accepted
+ * connections.
+ *
  * Returns:
  *	These functions return file descriptors on success, and -1
  *	on failure. ixp_errbuf(3) may be inspected on failure.
@@ -131,7 +131,7 @@ ixp_srv_readbuf(Ixp9Req *req, char *buf, uint len) {
 	len -= req->ifcall.io.offset;
 	if(len > req->ifcall.io.count)
 		len = req->ifcall.io.count;
-	req->ofcall.io.data = emalloc(len);
+	req->ofcall.io.data = ixp_reqalloc(req, len);
 	memcpy(req->ofcall.io.data, buf + req->ifcall.io.offset, len);
 	req->ofcall.io.count = len;
 }
@@ -189,9 +189,12 @@ ixp_srv_data2cstring(Ixp9Req *req) {
 	if(q)
 		i = q - p;
 
-	p = erealloc(req->ifcall.io.data, i+1);
+	if(i == req->ifcall.io.count) {
+		p = ixp_reqalloc(req, i+1);
+		memcpy(p, req->ifcall.io.data, i);
+		req->ifcall.io.data = p;
+	}
 	p[i] = '\0';
-	req->ifcall.io.data = p;
 }
 
 /**
@@ -528,7 +531,7 @@ ixp_srv_readdir(Ixp9Req *req, IxpLookupFn lookup, void (*dostat)(IxpStat*, IxpFi
 	size = req->ifcall.io.count;
 	if(size > req->fid->iounit)
 		size = req->fid->iounit;
-	buf = emallocz(size);
+	buf = ixp_reqalloc(req, size);
 	msg = ixp_message(buf, size, MsgPack);
 
 	file = lookup(file, nil);
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
 #include "ixp_local.h"
 
 /* 
@@ -26,6 +27,18 @@ ixp_msec(void) {
 	return (uint64_t)tv.tv_sec*1000 + (uint64_t)tv.tv_usec/1000;
 }
 
+/*
+ * Returns a monotonic time in nanoseconds, for measuring
+ * intervals.
+ */
+uint64_t
+ixp_nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
 /**
  * Function: ixp_settimer
  *
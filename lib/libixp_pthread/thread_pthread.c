@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include "ixp_local.h"
 
@@ -132,6 +133,20 @@ rsleep(IxpRendez *r) {
 	pthread_cond_wait(r->aux, r->mutex->aux);
 }
 
+static void
+rtsleep(IxpRendez *r, long msec) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += msec / 1000;
+	ts.tv_nsec += msec % 1000 * 1000000;
+	if(ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(r->aux, r->mutex->aux, &ts);
+}
+
 static int
 rwake(IxpRendez *r) {
 	pthread_cond_signal(r->aux);
@@ -191,5 +206,7 @@ static IxpThread ixp_pthread = {
 	.read = read,
 	.write = write,
 	.select = select,
+	/* Optional */
+	.tsleep = rtsleep,
 };
 
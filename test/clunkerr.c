@@ -0,0 +1,147 @@
+#include <u.h>
+#include <libc.h>
+#include <thread.h>
+#include <ixp.h>
+
+/*
+ * Checks that the client releases a fid whose clunk is answered
+ * with an error, since the server forgets it either way, by
+ * reading, writing and stating a file many times through a
+ * server whose clunk handler always fails, and checking that the
+ * fid numbers it's sent stay few.
+ */
+
+extern char *(*_syserrstr)(void);
+
+enum {
+	Rounds = 200,
+	Maxfid = 8,
+};
+
+static ulong maxfid;
+
+static void
+fs_attach(Ixp9Req *r) {
+	r->fid->qid.type = P9_QTDIR;
+	r->fid->qid.path = 1;
+	r->ofcall.rattach.qid = r->fid->qid;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_walk(Ixp9Req *r) {
+	int i;
+
+	if(r->ifcall.twalk.newfid > maxfid)
+		maxfid = r->ifcall.twalk.newfid;
+	for(i=0; i < r->ifcall.twalk.nwname; i++) {
+		r->ofcall.rwalk.wqid[i].type = P9_QTFILE;
+		r->ofcall.rwalk.wqid[i].path = 2;
+	}
+	r->ofcall.rwalk.nwqid = i;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_read(Ixp9Req *r) {
+	r->ofcall.rread.count = 0;
+	if(r->ifcall.tread.offset == 0) {
+		r->ofcall.rread.count = 5;
+		r->ofcall.rread.data = ixp_reqalloc(r, 5);
+		memmove(r->ofcall.rread.data, "hello", 5);
+	}
+	ixp_respond(r, nil);
+}
+
+static void
+fs_write(Ixp9Req *r) {
+	r->ofcall.rwrite.count = r->ifcall.twrite.count;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_stat(Ixp9Req *r) {
+	IxpStat s;
+	IxpMsg m;
+	int size;
+
+	memset(&s, 0, sizeof s);
+	s.qid = r->fid->qid;
+	s.name = "data";
+	s.uid = s.gid = s.muid = "none";
+	size = ixp_sizeof_stat(&s);
+	m = ixp_message(ixp_reqalloc(r, size), size, MsgPack);
+	ixp_pstat(&m, &s);
+	r->ofcall.rstat.nstat = size;
+	r->ofcall.rstat.stat = (uchar*)m.data;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_clunk(Ixp9Req *r) {
+	ixp_respond(r, "clunk failed");
+}
+
+static void
+fs_respond(Ixp9Req *r) {
+	ixp_respond(r, nil);
+}
+
+static Ixp9Srv srv = {
+	.attach = fs_attach,
+	.walk = fs_walk,
+	.open = fs_respond,
+	.read = fs_read,
+	.write = fs_write,
+	.stat = fs_stat,
+	.clunk = fs_clunk,
+};
+
+void
+threadmain(int argc, char *argv[]) {
+	IxpClient *c;
+	IxpCFid *f;
+	IxpStat *st;
+	char buf[16];
+	const char *paths[2];
+	char *err[2];
+	IxpStat *stats[2];
+	int i;
+
+	USED(argc);
+	USED(argv);
+	_syserrstr = ixp_errbuf;
+	if(ixp_pthread_init())
+		sysfatal("can't init pthread: %r\n");
+
+	c = ixp_mountsrv(&srv);
+	if(c == nil)
+		sysfatal("can't mount: %r\n");
+
+	paths[0] = "/a";
+	paths[1] = "/b";
+	for(i=0; i < Rounds; i++) {
+		if(ixp_readfile(c, "/data", buf, sizeof buf) != 5)
+			sysfatal("readfile: %r\n");
+		ixp_writefile(c, "/data", "hello", 5);
+		if(ixp_statv(c, paths, 2, stats, err) != 2)
+			sysfatal("statv: %r\n");
+		ixp_freestat(stats[0]);
+		ixp_freestat(stats[1]);
+		free(stats[0]);
+		free(stats[1]);
+		if((st = ixp_stat(c, "/data")) == nil)
+			sysfatal("stat: %r\n");
+		ixp_freestat(st);
+		free(st);
+		if((f = ixp_open(c, "/data", P9_OREAD)) == nil)
+			sysfatal("open: %r\n");
+		ixp_close(f);
+	}
+	if(maxfid > Maxfid)
+		sysfatal("fids leaked: highest fid %lud after %d rounds\n", maxfid, Rounds);
+	print("ok: highest fid %lud\n", maxfid);
+
+	ixp_unmount(c);
+	threadexitsall(nil);
+}
@@ -0,0 +1,188 @@
+#include <u.h>
+#include <libc.h>
+#include <thread.h>
+#include <ixp.h>
+
+/*
+ * Checks that a server at its maxinflight limit handles each
+ * fid's requests in order, by reading a file while reads of an
+ * event file take every slot, so that the walk, open and read
+ * ixp_readfile sends are queued, and its clunk must wait behind
+ * them. A clunk run ahead of its walk fails, and the walk then
+ * leaves behind a fid which the client believes free, and which
+ * its next walk collides with. The limit leaves room to queue
+ * the whole chain, since the server stops reading a connection
+ * once as many requests are queued as it allows in flight.
+ */
+
+extern char *(*_syserrstr)(void);
+
+enum {
+	Maxinflight = 4,
+	Rounds = 3,
+};
+
+static IxpServer srv;
+
+static struct {
+	QLock		lk;
+	Ixp9Req*	req[Maxinflight];
+	int		n;
+} park;
+
+static struct {
+	QLock	lk;
+	Rendez	r;
+	int	done;
+} reader;
+
+static void
+fs_attach(Ixp9Req *r) {
+	r->fid->qid.type = P9_QTDIR;
+	r->fid->qid.path = 0;
+	r->ofcall.rattach.qid = r->fid->qid;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_walk(Ixp9Req *r) {
+	if(r->ifcall.twalk.nwname != 1) {
+		ixp_respond(r, "bad path");
+		return;
+	}
+	r->ofcall.rwalk.wqid[0].type = P9_QTFILE;
+	r->ofcall.rwalk.wqid[0].path = !strcmp(r->ifcall.twalk.wname[0], "event");
+	r->ofcall.rwalk.nwqid = 1;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_read(Ixp9Req *r) {
+	if(r->fid->qid.path == 1) {
+		qlock(&park.lk);
+		if(park.n == nelem(park.req))
+			sysfatal("more reads than maxinflight reached the handler\n");
+		park.req[park.n++] = r;
+		qunlock(&park.lk);
+		return;
+	}
+	r->ofcall.rread.count = 0;
+	if(r->ifcall.tread.offset == 0) {
+		r->ofcall.rread.count = 5;
+		r->ofcall.rread.data = ixp_reqalloc(r, 5);
+		memmove(r->ofcall.rread.data, "hello", 5);
+	}
+	ixp_respond(r, nil);
+}
+
+static void
+fs_respond(Ixp9Req *r) {
+	ixp_respond(r, nil);
+}
+
+static Ixp9Srv fs = {
+	.attach = fs_attach,
+	.walk = fs_walk,
+	.open = fs_respond,
+	.read = fs_read,
+	.clunk = fs_respond,
+	.maxinflight = Maxinflight,
+};
+
+static void
+release(void) {
+	Ixp9Req *r;
+
+	qlock(&park.lk);
+	if(park.n != Maxinflight)
+		sysfatal("%d event reads reached the handler, not %d\n", park.n, Maxinflight);
+	while(park.n > 0) {
+		r = park.req[--park.n];
+		r->ofcall.rread.count = 5;
+		r->ofcall.rread.data = ixp_reqalloc(r, 5);
+		memmove(r->ofcall.rread.data, "event", 5);
+		ixp_respond(r, nil);
+	}
+	qunlock(&park.lk);
+}
+
+static void
+readproc(void *v) {
+	char buf[16];
+
+	if(ixp_readfile(v, "/data", buf, sizeof buf) != 5)
+		sysfatal("readfile behind a held read: %r\n");
+	qlock(&reader.lk);
+	reader.done = 1;
+	rwakeup(&reader.r);
+	qunlock(&reader.lk);
+}
+
+static void
+serveproc(void *v) {
+	USED(v);
+	ixp_serverloop(&srv);
+}
+
+static void
+watchdog(void *v) {
+	USED(v);
+	sleep(10000);
+	sysfatal("stalled\n");
+}
+
+void
+threadmain(int argc, char *argv[]) {
+	IxpClient *c;
+	IxpCFid *f;
+	IxpRpc *r[Maxinflight];
+	char address[64], buf[Maxinflight][8];
+	int fd, i, j;
+
+	USED(argc);
+	USED(argv);
+	_syserrstr = ixp_errbuf;
+	if(ixp_pthread_init())
+		sysfatal("can't init pthread: %r\n");
+	proccreate(watchdog, nil, mainstacksize);
+	reader.r.l = &reader.lk;
+
+	snprint(address, sizeof address, "unix!/tmp/clunkorder.%d", getpid());
+	fd = ixp_announce(address);
+	if(fd < 0)
+		sysfatal("can't announce: %r\n");
+	ixp_listen(&srv, fd, &fs, ixp_serve9conn, nil);
+	proccreate(serveproc, nil, mainstacksize);
+
+	c = ixp_mount(address);
+	if(c == nil)
+		sysfatal("can't mount: %r\n");
+	f = ixp_open(c, "/event", OREAD);
+	if(f == nil)
+		sysfatal("can't open: %r\n");
+
+	for(i=0; i < Rounds; i++) {
+		for(j=0; j < Maxinflight; j++)
+			r[j] = ixp_apread(f, buf[j], 5, 0, nil, nil);
+		sleep(50);
+		reader.done = 0;
+		proccreate(readproc, c, mainstacksize);
+		sleep(100);
+		release();
+		for(j=0; j < Maxinflight; j++)
+			if(ixp_await(r[j]) != 5)
+				sysfatal("event read: %r\n");
+		qlock(&reader.lk);
+		while(!reader.done)
+			rsleep(&reader.r);
+		qunlock(&reader.lk);
+	}
+	if(ixp_readfile(c, "/data", buf[0], sizeof buf[0]) != 5)
+		sysfatal("readfile: %r\n");
+	print("ok\n");
+
+	ixp_close(f);
+	ixp_unmount(c);
+	remove(address + strlen("unix!"));
+	threadexitsall(nil);
+}
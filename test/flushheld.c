@@ -0,0 +1,187 @@
+#include <u.h>
+#include <libc.h>
+#include <thread.h>
+#include <ixp.h>
+
+/*
+ * Checks that a client whose requests in flight are at its
+ * server's maxinflight limit, all taken by reads left pending on
+ * an event file, can still flush them, both once they've reached
+ * the server's handlers and while they're queued behind the
+ * limit.
+ */
+
+extern char *(*_syserrstr)(void);
+
+enum {
+	Maxinflight = 4,
+	Timeout = 300,
+};
+
+static IxpServer srv;
+
+static struct {
+	QLock		lk;
+	Ixp9Req*	req[Maxinflight + 1];
+	int		n;
+} park;
+
+static void
+fs_attach(Ixp9Req *r) {
+	r->fid->qid.type = P9_QTDIR;
+	r->fid->qid.path = 1;
+	r->ofcall.rattach.qid = r->fid->qid;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_walk(Ixp9Req *r) {
+	int i;
+
+	for(i=0; i < r->ifcall.twalk.nwname; i++) {
+		r->ofcall.rwalk.wqid[i].type = P9_QTFILE;
+		r->ofcall.rwalk.wqid[i].path = 2;
+	}
+	r->ofcall.rwalk.nwqid = i;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_read(Ixp9Req *r) {
+	qlock(&park.lk);
+	if(park.n == nelem(park.req))
+		sysfatal("more reads than maxinflight reached the handler\n");
+	park.req[park.n++] = r;
+	qunlock(&park.lk);
+}
+
+static void
+fs_flush(Ixp9Req *r) {
+	int i;
+
+	qlock(&park.lk);
+	for(i=0; i < park.n; i++)
+		if(park.req[i] == r->oldreq) {
+			park.req[i] = park.req[--park.n];
+			break;
+		}
+	qunlock(&park.lk);
+	ixp_respond(r, nil);
+}
+
+static void
+fs_respond(Ixp9Req *r) {
+	ixp_respond(r, nil);
+}
+
+static Ixp9Srv fs = {
+	.attach = fs_attach,
+	.walk = fs_walk,
+	.open = fs_respond,
+	.read = fs_read,
+	.flush = fs_flush,
+	.clunk = fs_respond,
+	.maxinflight = Maxinflight,
+};
+
+static int
+parked(void) {
+	int n;
+
+	qlock(&park.lk);
+	n = park.n;
+	qunlock(&park.lk);
+	return n;
+}
+
+static void
+release(void) {
+	Ixp9Req *r;
+
+	qlock(&park.lk);
+	while(park.n > 0) {
+		r = park.req[--park.n];
+		r->ofcall.rread.count = 5;
+		r->ofcall.rread.data = ixp_reqalloc(r, 5);
+		memmove(r->ofcall.rread.data, "event", 5);
+		ixp_respond(r, nil);
+	}
+	qunlock(&park.lk);
+}
+
+static void
+serveproc(void *v) {
+	USED(v);
+	ixp_serverloop(&srv);
+}
+
+static void
+watchdog(void *v) {
+	USED(v);
+	sleep(10000);
+	sysfatal("stalled\n");
+}
+
+void
+threadmain(int argc, char *argv[]) {
+	IxpClient *c;
+	IxpCFid *f;
+	IxpRpc *r[Maxinflight + 1];
+	char address[64], buf[Maxinflight + 2][8];
+	int fd, i;
+
+	USED(argc);
+	USED(argv);
+	_syserrstr = ixp_errbuf;
+	if(ixp_pthread_init())
+		sysfatal("can't init pthread: %r\n");
+	proccreate(watchdog, nil, mainstacksize);
+
+	snprint(address, sizeof address, "unix!/tmp/flushheld.%d", getpid());
+	fd = ixp_announce(address);
+	if(fd < 0)
+		sysfatal("can't announce: %r\n");
+	ixp_listen(&srv, fd, &fs, ixp_serve9conn, nil);
+	proccreate(serveproc, nil, mainstacksize);
+
+	c = ixp_mount(address);
+	if(c == nil)
+		sysfatal("can't mount: %r\n");
+	f = ixp_open(c, "/event", OREAD);
+	if(f == nil)
+		sysfatal("can't open: %r\n");
+
+	/* Fill the limit, with one request to spare, queued. */
+	f->timeout = Timeout;
+	r[0] = ixp_apread(f, buf[0], 5, 0, nil, nil);
+	f->timeout = 0;
+	for(i=1; i <= Maxinflight; i++)
+		r[i] = ixp_apread(f, buf[i], 5, 0, nil, nil);
+	sleep(100);
+	if(parked() != Maxinflight)
+		sysfatal("%d reads reached the handler, not %d\n", parked(), Maxinflight);
+
+	/* Flushing one which reached the handler lets the queued one in. */
+	if(ixp_await(r[0]) >= 0)
+		sysfatal("read answered, not flushed\n");
+	sleep(100);
+	if(parked() != Maxinflight)
+		sysfatal("queued read not passed on after a flush: %d parked\n", parked());
+
+	/* One queued behind the limit is flushed from the queue. */
+	f->timeout = Timeout;
+	if(ixp_pread(f, buf[Maxinflight + 1], 5, 0) >= 0)
+		sysfatal("read answered, not flushed\n");
+	f->timeout = 0;
+
+	release();
+	for(i=1; i <= Maxinflight; i++)
+		if(ixp_await(r[i]) != 5)
+			sysfatal("read %d: %r\n", i);
+	print("ok\n");
+
+	ixp_close(f);
+	ixp_unmount(c);
+	remove(address + strlen("unix!"));
+	threadexitsall(nil);
+}
@@ -0,0 +1,214 @@
+#include <u.h>
+#include <libc.h>
+#include <thread.h>
+#include <ixp.h>
+
+/*
+ * Exercises the loopback transport of ixp_mountsrv: reads,
+ * writes and stats through it, a handler which makes requests of
+ * the same client, and a slow handler, which must not hold up
+ * requests sent from other threads meanwhile.
+ */
+
+extern char *(*_syserrstr)(void);
+
+enum {
+	Slow = 500,
+};
+
+static IxpClient *client;
+static char data[64] = "hello";
+static long ndata = 5;
+
+static struct {
+	QLock	lk;
+	Rendez	r;
+	int	done;
+} slow;
+
+static void
+fs_attach(Ixp9Req *r) {
+	r->fid->qid.type = P9_QTDIR;
+	r->fid->qid.path = 0;
+	r->ofcall.rattach.qid = r->fid->qid;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_walk(Ixp9Req *r) {
+	char *name;
+
+	if(r->ifcall.twalk.nwname != 1) {
+		ixp_respond(r, "bad path");
+		return;
+	}
+	name = r->ifcall.twalk.wname[0];
+	r->ofcall.rwalk.wqid[0].type = P9_QTFILE;
+	if(!strcmp(name, "data"))
+		r->ofcall.rwalk.wqid[0].path = 1;
+	else if(!strcmp(name, "slow"))
+		r->ofcall.rwalk.wqid[0].path = 2;
+	else if(!strcmp(name, "nested"))
+		r->ofcall.rwalk.wqid[0].path = 3;
+	else {
+		ixp_respond(r, "file not found");
+		return;
+	}
+	r->ofcall.rwalk.nwqid = 1;
+	ixp_respond(r, nil);
+}
+
+static void
+reply(Ixp9Req *r, char *buf, long n) {
+	if(r->ifcall.tread.offset >= n)
+		n = 0;
+	r->ofcall.rread.count = n;
+	r->ofcall.rread.data = ixp_reqalloc(r, n);
+	memmove(r->ofcall.rread.data, buf, n);
+	ixp_respond(r, nil);
+}
+
+static void
+fs_read(Ixp9Req *r) {
+	char buf[64];
+	long n;
+
+	switch(r->fid->qid.path) {
+	case 1:
+		reply(r, data, ndata);
+		break;
+	case 2:
+		sleep(Slow);
+		reply(r, "slow", 4);
+		break;
+	case 3:
+		n = ixp_readfile(client, "/data", buf, sizeof buf);
+		if(n < 0) {
+			ixp_respond(r, ixp_errbuf());
+			break;
+		}
+		reply(r, buf, n);
+		break;
+	}
+}
+
+static void
+fs_write(Ixp9Req *r) {
+	if(r->ifcall.twrite.offset + r->ifcall.twrite.count > sizeof data) {
+		ixp_respond(r, "file too large");
+		return;
+	}
+	memmove(data + r->ifcall.twrite.offset, r->ifcall.twrite.data, r->ifcall.twrite.count);
+	ndata = r->ifcall.twrite.offset + r->ifcall.twrite.count;
+	r->ofcall.rwrite.count = r->ifcall.twrite.count;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_stat(Ixp9Req *r) {
+	IxpStat s;
+	IxpMsg m;
+	int size;
+
+	memset(&s, 0, sizeof s);
+	s.qid = r->fid->qid;
+	s.name = "data";
+	s.uid = s.gid = s.muid = "none";
+	s.length = ndata;
+	size = ixp_sizeof_stat(&s);
+	m = ixp_message(ixp_reqalloc(r, size), size, MsgPack);
+	ixp_pstat(&m, &s);
+	r->ofcall.rstat.nstat = size;
+	r->ofcall.rstat.stat = (uchar*)m.data;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_respond(Ixp9Req *r) {
+	ixp_respond(r, nil);
+}
+
+static Ixp9Srv srv = {
+	.attach = fs_attach,
+	.walk = fs_walk,
+	.open = fs_respond,
+	.read = fs_read,
+	.write = fs_write,
+	.stat = fs_stat,
+	.clunk = fs_respond,
+};
+
+static void
+slowproc(void *v) {
+	char buf[8];
+
+	USED(v);
+	if(ixp_readfile(client, "/slow", buf, sizeof buf) != 4)
+		sysfatal("slow read: %r\n");
+	qlock(&slow.lk);
+	slow.done = 1;
+	rwakeup(&slow.r);
+	qunlock(&slow.lk);
+}
+
+static void
+watchdog(void *v) {
+	USED(v);
+	sleep(10000);
+	sysfatal("stalled\n");
+}
+
+void
+threadmain(int argc, char *argv[]) {
+	IxpStat *st;
+	char buf[64];
+	vlong t;
+	long n;
+
+	USED(argc);
+	USED(argv);
+	_syserrstr = ixp_errbuf;
+	if(ixp_pthread_init())
+		sysfatal("can't init pthread: %r\n");
+	proccreate(watchdog, nil, mainstacksize);
+	slow.r.l = &slow.lk;
+
+	client = ixp_mountsrv(&srv);
+	if(client == nil)
+		sysfatal("can't mount: %r\n");
+
+	n = ixp_readfile(client, "/data", buf, sizeof buf);
+	if(n != 5 || memcmp(buf, "hello", 5))
+		sysfatal("read: %r\n");
+	if(ixp_writefile(client, "/data", "hello, world", 12) != 12)
+		sysfatal("write: %r\n");
+	st = ixp_stat(client, "/data");
+	if(st == nil || st->length != 12)
+		sysfatal("stat: %r\n");
+	ixp_freestat(st);
+	free(st);
+	if(ixp_readfile(client, "/missing", buf, sizeof buf) >= 0)
+		sysfatal("read of a missing file succeeded\n");
+
+	n = ixp_readfile(client, "/nested", buf, sizeof buf);
+	if(n != 12 || memcmp(buf, "hello, world", 12))
+		sysfatal("nested read: %r\n");
+
+	proccreate(slowproc, nil, mainstacksize);
+	sleep(50);
+	t = nsec();
+	if(ixp_readfile(client, "/data", buf, sizeof buf) != 12)
+		sysfatal("read beside a slow handler: %r\n");
+	t = (nsec() - t) / 1000000;
+	if(t > Slow / 2)
+		sysfatal("read held up %lld ms by a slow handler\n", t);
+
+	qlock(&slow.lk);
+	while(!slow.done)
+		rsleep(&slow.r);
+	qunlock(&slow.lk);
+	print("ok\n");
+
+	ixp_unmount(client);
+	threadexitsall(nil);
+}
@@ -0,0 +1,192 @@
+#include <u.h>
+#include <libc.h>
+#include <thread.h>
+#include <ixp.h>
+
+/*
+ * Compares RPC latency with the default elected muxer against a
+ * dedicated ixp_clientloop receiver, for 1, 8 and 64 threads
+ * sharing a client connected to an in-process server over a
+ * unix domain socket.
+ */
+
+extern char *(*_syserrstr)(void);
+
+typedef struct Run Run;
+struct Run {
+	IxpClient*	c;
+	vlong*		lat;
+	int		nrpc;
+	int		nleft;
+	QLock		lk;
+	Rendez		r;
+};
+
+static int nrpc = 2000;
+static int nthreads[] = { 1, 8, 64 };
+static IxpServer srv;
+
+static void
+usage(void) {
+	fprint(2, "usage: %s [-n <rpcs per thread>]\n", argv0);
+	threadexitsall("usage");
+}
+
+static void
+fs_attach(Ixp9Req *r) {
+	r->fid->qid.type = P9_QTDIR;
+	r->fid->qid.path = 1;
+	r->ofcall.rattach.qid = r->fid->qid;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_walk(Ixp9Req *r) {
+	int i;
+
+	for(i=0; i < r->ifcall.twalk.nwname; i++) {
+		r->ofcall.rwalk.wqid[i].type = P9_QTFILE;
+		r->ofcall.rwalk.wqid[i].path = 2;
+	}
+	r->ofcall.rwalk.nwqid = i;
+	ixp_respond(r, nil);
+}
+
+static void
+fs_read(Ixp9Req *r) {
+	r->ofcall.rread.count = 64;
+	r->ofcall.rread.data = mallocz(64, 1);
+	ixp_respond(r, nil);
+}
+
+static void
+fs_respond(Ixp9Req *r) {
+	ixp_respond(r, nil);
+}
+
+static Ixp9Srv fs = {
+	.attach = fs_attach,
+	.walk = fs_walk,
+	.open = fs_respond,
+	.read = fs_read,
+	.clunk = fs_respond,
+};
+
+static void
+serveproc(void *v) {
+	USED(v);
+	ixp_serverloop(&srv);
+}
+
+static void
+recvproc(void *v) {
+	ixp_clientloop(v);
+}
+
+static void
+clientproc(void *v) {
+	Run *run;
+	IxpCFid *f;
+	char buf[64];
+	vlong *lat, t;
+	int i;
+
+	run = v;
+	qlock(&run->lk);
+	lat = run->lat;
+	run->lat += run->nrpc;
+	qunlock(&run->lk);
+
+	f = ixp_open(run->c, "/data", OREAD);
+	if(f == nil)
+		sysfatal("can't open: %r\n");
+	for(i=0; i < run->nrpc; i++) {
+		t = nsec();
+		if(ixp_pread(f, buf, sizeof buf, 0) != sizeof buf)
+			sysfatal("read: %r\n");
+		lat[i] = nsec() - t;
+	}
+	ixp_close(f);
+
+	qlock(&run->lk);
+	if(--run->nleft == 0)
+		rwakeup(&run->r);
+	qunlock(&run->lk);
+}
+
+static int
+vlongcmp(const void *a, const void *b) {
+	vlong x, y;
+
+	x = *(vlong*)a;
+	y = *(vlong*)b;
+	return (x > y) - (x < y);
+}
+
+static void
+bench(char *address, int dedicated, int n) {
+	Run run;
+	vlong *lat;
+	int i, total;
+
+	memset(&run, 0, sizeof run);
+	run.r.l = &run.lk;
+	run.c = ixp_mount(address);
+	if(run.c == nil)
+		sysfatal("can't mount: %r\n");
+	if(dedicated)
+		proccreate(recvproc, run.c, mainstacksize);
+
+	total = n * nrpc;
+	lat = malloc(total * sizeof *lat);
+	run.lat = lat;
+	run.nrpc = nrpc;
+	run.nleft = n;
+	for(i=0; i < n; i++)
+		proccreate(clientproc, &run, mainstacksize);
+
+	qlock(&run.lk);
+	while(run.nleft > 0)
+		rsleep(&run.r);
+	qunlock(&run.lk);
+
+	qsort(lat, total, sizeof *lat, vlongcmp);
+	print("%-9s %2d threads: p50 %7lld us  p99 %7lld us\n",
+	      dedicated ? "recvloop" : "elected", n,
+	      lat[total / 2] / 1000, lat[total * 99 / 100] / 1000);
+	free(lat);
+	ixp_unmount(run.c);
+}
+
+void
+threadmain(int argc, char *argv[]) {
+	char address[64];
+	int fd, i;
+
+	ARGBEGIN{
+	case 'n':
+		nrpc = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND;
+
+	_syserrstr = ixp_errbuf;
+	if(ixp_pthread_init())
+		sysfatal("can't init pthread: %r\n");
+
+	snprint(address, sizeof address, "unix!/tmp/muxlatency.%d", getpid());
+	fd = ixp_announce(address);
+	if(fd < 0)
+		sysfatal("can't announce: %r\n");
+	ixp_listen(&srv, fd, &fs, ixp_serve9conn, nil);
+	proccreate(serveproc, nil, mainstacksize);
+
+	for(i=0; i < nelem(nthreads); i++) {
+		bench(address, 0, nthreads[i]);
+		bench(address, 1, nthreads[i]);
+	}
+
+	remove(address + strlen("unix!"));
+	threadexitsall(nil);
+}
@@ -0,0 +1,172 @@
+#include <u.h>
+#include <libc.h>
+#include <thread.h>
+#include <ixp.h>
+
+/*
+ * Measures ixp_pwrite throughput with increasing write-behind
+ * windows, against an in-process server which holds each reply
+ * for a fixed latency before sending it.
+ */
+
+extern char *(*_syserrstr)(void);
+
+typedef struct Delayed Delayed;
+struct Delayed {
+	Ixp9Req*	req;
+	vlong		due;
+	Delayed*	next;
+};
+
+static struct {
+	QLock		lk;
+	Rendez		r;
+	Delayed*	head;
+	Delayed*	tail;
+} delay;
+
+static vlong latency = 1;
+static vlong size = 4096;
+static int windows[] = { 0, 1, 2, 4, 8, 16, 32 };
+
+static void
+usage(void) {
+	fprint(2, "usage: %s [-l <latency ms>] [-s <size KB>]\n", argv0);
+	threadexitsall("usage");
+}
+
+static void
+respondlater(Ixp9Req *r) {
+	Delayed *d;
+
+	d = malloc(sizeof *d);
+	d->req = r;
+	d->due = nsec() + latency * 1000000;
+	d->next = nil;
+
+	qlock(&delay.lk);
+	if(delay.tail)
+		delay.tail->next = d;
+	else
+		delay.head = d;
+	delay.tail = d;
+	rwakeup(&delay.r);
+	qunlock(&delay.lk);
+}
+
+static void
+delayproc(void *v) {
+	Delayed *d;
+	vlong now;
+
+	USED(v);
+	qlock(&delay.lk);
+	for(;;) {
+		while(delay.head == nil)
+			rsleep(&delay.r);
+		d = delay.head;
+		delay.head = d->next;
+		if(delay.head == nil)
+			delay.tail = nil;
+		qunlock(&delay.lk);
+
+		now = nsec();
+		if(d->due > now)
+			sleep((d->due - now + 999999) / 1000000);
+		ixp_respond(d->req, nil);
+		free(d);
+		qlock(&delay.lk);
+	}
+}
+
+static void
+fs_attach(Ixp9Req *r) {
+	r->fid->qid.type = P9_QTDIR;
+	r->fid->qid.path = 1;
+	r->ofcall.rattach.qid = r->fid->qid;
+	respondlater(r);
+}
+
+static void
+fs_walk(Ixp9Req *r) {
+	int i;
+
+	for(i=0; i < r->ifcall.twalk.nwname; i++) {
+		r->ofcall.rwalk.wqid[i].type = P9_QTFILE;
+		r->ofcall.rwalk.wqid[i].path = 2;
+	}
+	r->ofcall.rwalk.nwqid = i;
+	respondlater(r);
+}
+
+static void
+fs_write(Ixp9Req *r) {
+	r->ofcall.rwrite.count = r->ifcall.twrite.count;
+	respondlater(r);
+}
+
+static Ixp9Srv srv = {
+	.attach = fs_attach,
+	.walk = fs_walk,
+	.open = respondlater,
+	.write = fs_write,
+	.clunk = respondlater,
+};
+
+void
+threadmain(int argc, char *argv[]) {
+	IxpClient *c;
+	IxpCFid *f;
+	char *buf;
+	vlong off, t;
+	long n;
+	int i;
+
+	ARGBEGIN{
+	case 'l':
+		latency = strtoll(EARGF(usage()), nil, 0);
+		break;
+	case 's':
+		size = strtoll(EARGF(usage()), nil, 0);
+		break;
+	default:
+		usage();
+	}ARGEND;
+	size *= 1024;
+
+	_syserrstr = ixp_errbuf;
+	if(ixp_pthread_init())
+		sysfatal("can't init pthread: %r\n");
+
+	delay.r.l = &delay.lk;
+	proccreate(delayproc, nil, mainstacksize);
+
+	c = ixp_mountsrv(&srv);
+	if(c == nil)
+		sysfatal("can't mount: %r\n");
+	f = ixp_open(c, "/data", OWRITE);
+	if(f == nil)
+		sysfatal("can't open: %r\n");
+	buf = mallocz(f->iounit, 1);
+
+	print("%lld KB, %lld ms latency, iounit %d\n", size / 1024, latency, f->iounit);
+	for(i=0; i < nelem(windows); i++) {
+		f->writebehind = windows[i];
+		t = nsec();
+		for(off=0; off < size; off += n) {
+			n = f->iounit;
+			if(n > size - off)
+				n = size - off;
+			if(ixp_pwrite(f, buf, n, off) != n)
+				sysfatal("write: %r\n");
+		}
+		if(!ixp_flush(f))
+			sysfatal("flush: %r\n");
+		t = nsec() - t;
+		print("writebehind %2d: %8.2f MB/s\n", windows[i], size * 1000. / t);
+	}
+
+	ixp_close(f);
+	ixp_unmount(c);
+	threadexitsall(nil);
+}